@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <vector>
 
 template<typename T>
@@ -59,3 +60,84 @@ private:
 	size_t _width, _height, _depth;
 	std::vector<T> _data;
 };
+
+// Like Array3D<bool>, but each (x, y) is stored as a contiguous row of bits, packed into 64-bit words.
+// Bits past the depth in the last word of each row are always zero.
+struct BitArray3D
+{
+public:
+	using Word = uint64_t;
+	static const size_t kWordBits = 64;
+
+	BitArray3D() : _width(0), _height(0), _depth(0), _words_per_row(0) {}
+	BitArray3D(size_t w, size_t h, size_t d, bool value = false)
+		: _width(w), _height(h), _depth(d), _words_per_row((d + kWordBits - 1) / kWordBits)
+		, _data(w * h * _words_per_row, value ? ~Word(0) : Word(0))
+	{
+		if (value && d % kWordBits != 0) {
+			const Word last_word = (Word(1) << (d % kWordBits)) - 1;
+			for (size_t i = _words_per_row - 1; i < _data.size(); i += _words_per_row) {
+				_data[i] = last_word;
+			}
+		}
+	}
+
+	const size_t row_index(size_t x, size_t y) const
+	{
+		DCHECK_LT_F(x, _width);
+		DCHECK_LT_F(y, _height);
+		return (x * _height + y) * _words_per_row;
+	}
+
+	inline bool get(size_t x, size_t y, size_t z) const
+	{
+		DCHECK_LT_F(z, _depth);
+		return (_data[row_index(x, y) + z / kWordBits] >> (z % kWordBits)) & 1;
+	}
+
+	inline void set(size_t x, size_t y, size_t z, bool value)
+	{
+		DCHECK_LT_F(z, _depth);
+		Word& word = _data[row_index(x, y) + z / kWordBits];
+		const Word bit = Word(1) << (z % kWordBits);
+		if (value) { word |= bit; } else { word &= ~bit; }
+	}
+
+	inline       Word* mut_row(size_t x, size_t y)       { return &_data[row_index(x, y)]; }
+	inline const Word*     row(size_t x, size_t y) const { return &_data[row_index(x, y)]; }
+
+	// Calls fun(z) for each z where get(x, y, z) is true, in increasing order.
+	template<typename Fun>
+	void for_each_set(size_t x, size_t y, const Fun& fun) const
+	{
+		const Word* words = row(x, y);
+		for (size_t w = 0; w < _words_per_row; ++w) {
+			for (Word bits = words[w]; bits != 0; bits &= bits - 1) {
+				fun(w * kWordBits + __builtin_ctzll(bits));
+			}
+		}
+	}
+
+	// The first z where get(x, y, z) is true and pred(z) returns true, or depth() if there is none.
+	template<typename Pred>
+	size_t find_set_if(size_t x, size_t y, const Pred& pred) const
+	{
+		const Word* words = row(x, y);
+		for (size_t w = 0; w < _words_per_row; ++w) {
+			for (Word bits = words[w]; bits != 0; bits &= bits - 1) {
+				const size_t z = w * kWordBits + __builtin_ctzll(bits);
+				if (pred(z)) { return z; }
+			}
+		}
+		return _depth;
+	}
+
+	size_t width()         const { return _width;         }
+	size_t height()        const { return _height;        }
+	size_t depth()         const { return _depth;         }
+	size_t words_per_row() const { return _words_per_row; }
+
+private:
+	size_t _width, _height, _depth, _words_per_row;
+	std::vector<Word> _data;
+};
@@ -0,0 +1,129 @@
+#pragma once
+
+// Kernels over rows of bits packed into 64-bit words (see BitArray3D).
+// The best implementation the CPU supports (AVX2, SSE4.2 or plain C++) is picked at runtime.
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__x86_64__)
+	#include <immintrin.h>
+	#define BIT_KERNELS_X86 1
+#else
+	#define BIT_KERNELS_X86 0
+#endif
+
+struct BitKernels
+{
+	using Word = uint64_t;
+
+	const char* name;
+
+	// dst |= src
+	void   (*or_into)(Word* dst, const Word* src, size_t num_words);
+
+	// Is any bit set in a which is not set in b? (i.e. would a &= b change a?)
+	bool   (*any_and_not)(const Word* a, const Word* b, size_t num_words);
+};
+
+// ----------------------------------------------------------------------------
+
+inline void or_into_scalar(uint64_t* dst, const uint64_t* src, size_t num_words)
+{
+	for (size_t i = 0; i < num_words; ++i) {
+		dst[i] |= src[i];
+	}
+}
+
+inline bool any_and_not_scalar(const uint64_t* a, const uint64_t* b, size_t num_words)
+{
+	for (size_t i = 0; i < num_words; ++i) {
+		if (a[i] & ~b[i]) { return true; }
+	}
+	return false;
+}
+
+#if BIT_KERNELS_X86
+
+__attribute__((target("sse4.2")))
+inline void or_into_sse(uint64_t* dst, const uint64_t* src, size_t num_words)
+{
+	size_t i = 0;
+	for (; i + 2 <= num_words; i += 2) {
+		const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i));
+		const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_or_si128(a, b));
+	}
+	for (; i < num_words; ++i) {
+		dst[i] |= src[i];
+	}
+}
+
+__attribute__((target("sse4.2")))
+inline bool any_and_not_sse(const uint64_t* a, const uint64_t* b, size_t num_words)
+{
+	size_t i = 0;
+	for (; i + 2 <= num_words; i += 2) {
+		const __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+		const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+		if (!_mm_testc_si128(vb, va)) { return true; } // testc is true iff (~vb & va) == 0
+	}
+	for (; i < num_words; ++i) {
+		if (a[i] & ~b[i]) { return true; }
+	}
+	return false;
+}
+
+__attribute__((target("avx2")))
+inline void or_into_avx2(uint64_t* dst, const uint64_t* src, size_t num_words)
+{
+	size_t i = 0;
+	for (; i + 4 <= num_words; i += 4) {
+		const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + i));
+		const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_or_si256(a, b));
+	}
+	for (; i < num_words; ++i) {
+		dst[i] |= src[i];
+	}
+}
+
+__attribute__((target("avx2")))
+inline bool any_and_not_avx2(const uint64_t* a, const uint64_t* b, size_t num_words)
+{
+	size_t i = 0;
+	for (; i + 4 <= num_words; i += 4) {
+		const __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+		const __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+		if (!_mm256_testc_si256(vb, va)) { return true; }
+	}
+	for (; i < num_words; ++i) {
+		if (a[i] & ~b[i]) { return true; }
+	}
+	return false;
+}
+
+#endif // BIT_KERNELS_X86
+
+// ----------------------------------------------------------------------------
+
+inline BitKernels select_bit_kernels()
+{
+#if BIT_KERNELS_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		return BitKernels{"AVX2", or_into_avx2, any_and_not_avx2};
+	}
+	if (__builtin_cpu_supports("sse4.2")) {
+		return BitKernels{"SSE4.2", or_into_sse, any_and_not_sse};
+	}
+#endif
+	return BitKernels{"scalar", or_into_scalar, any_and_not_scalar};
+}
+
+// The kernels to use on this CPU.
+inline const BitKernels& bit_kernels()
+{
+	static const BitKernels s_kernels = select_bit_kernels();
+	return s_kernels;
+}
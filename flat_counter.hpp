@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "hash.hpp"
+
+// Counts occurrences of byte strings of a fixed size in an open-addressing hash table (linear probing).
+// Unlike std::unordered_map there is no allocation per key, and the keys are kept in the order
+// they were first added, so iterating is deterministic.
+class FlatCounter
+{
+public:
+	explicit FlatCounter(size_t key_size) : _key_size(key_size), _slots(16, 0) {}
+
+	// Returns the index of the key, i.e. the number of different keys added before it.
+	size_t add(const void* key, size_t amount = 1)
+	{
+		const uint64_t hash = hash_bytes(key, _key_size);
+		size_t slot = hash & (_slots.size() - 1);
+		while (_slots[slot] != 0) {
+			const size_t index = _slots[slot] - 1;
+			if (_hashes[index] == hash && memcmp(this->key(index), key, _key_size) == 0) {
+				_counts[index] += amount;
+				return index;
+			}
+			slot = (slot + 1) & (_slots.size() - 1);
+		}
+
+		const size_t index = _counts.size();
+		_keys.insert(_keys.end(), static_cast<const uint8_t*>(key), static_cast<const uint8_t*>(key) + _key_size);
+		_hashes.push_back(hash);
+		_counts.push_back(amount);
+		_slots[slot] = index + 1;
+		if (2 * _counts.size() > _slots.size()) {
+			grow();
+		}
+		return index;
+	}
+
+	size_t size() const { return _counts.size(); }
+
+	// Indexed in the order the keys were first added.
+	const uint8_t* key(size_t index)   const { return _keys.data() + index * _key_size; }
+	size_t         count(size_t index) const { return _counts[index]; }
+
+private:
+	// Eight bytes at a time, with a murmur-style finalizer.
+	static uint64_t hash_bytes(const void* data, size_t size)
+	{
+		const uint8_t* bytes = static_cast<const uint8_t*>(data);
+		uint64_t hash = 0x9E3779B97F4A7C15ull ^ size;
+		for (; size >= 8; bytes += 8, size -= 8) {
+			uint64_t word;
+			memcpy(&word, bytes, 8);
+			hash = (hash ^ word) * 0xC2B2AE3D27D4EB4Full;
+			hash ^= hash >> 29;
+		}
+		if (size > 0) {
+			uint64_t word = 0;
+			memcpy(&word, bytes, size);
+			hash = (hash ^ word) * 0xC2B2AE3D27D4EB4Full;
+		}
+		return mix64(hash);
+	}
+
+	void grow()
+	{
+		_slots.assign(2 * _slots.size(), 0);
+		for (size_t index = 0; index < _counts.size(); ++index) {
+			size_t slot = _hashes[index] & (_slots.size() - 1);
+			while (_slots[slot] != 0) {
+				slot = (slot + 1) & (_slots.size() - 1);
+			}
+			_slots[slot] = index + 1;
+		}
+	}
+
+	size_t                _key_size;
+	std::vector<size_t>   _slots;  // Power of two. 1 + index of the key, or 0 if empty.
+	std::vector<uint8_t>  _keys;   // size() * _key_size
+	std::vector<uint64_t> _hashes; // Of each key
+	std::vector<size_t>   _counts; // Of each key
+};
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+const uint64_t kFnvOffsetBasis = 0xCBF29CE484222325ull;
+
+// FNV-1a over the bytes, continuing from hash (start from kFnvOffsetBasis).
+inline uint64_t fnv1a(uint64_t hash, const void* data, size_t size)
+{
+	const uint8_t* bytes = static_cast<const uint8_t*>(data);
+	for (size_t i = 0; i < size; ++i) {
+		hash = (hash ^ bytes[i]) * 0x100000001B3ull;
+	}
+	return hash;
+}
+
+// Spreads the bits of x over all of the result, so that nearby inputs give unrelated outputs
+// (the first half of the MurmurHash3 finalizer).
+inline uint64_t mix64(uint64_t x)
+{
+	x ^= x >> 33;
+	x *= 0xFF51AFD7ED558CCDull;
+	x ^= x >> 33;
+	return x;
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <vector>
+
+#include <loguru.hpp>
+
+// A binary min-heap over the items 0..N-1, keyed by a double.
+// Unlike std::priority_queue, the key of any item can be changed, and any item removed, in O(log N).
+class IndexedMinHeap
+{
+public:
+	IndexedMinHeap() {}
+	explicit IndexedMinHeap(size_t num_items)
+		: _keys(num_items, 0.0), _position(num_items, kAbsent) {}
+
+	bool   empty()    const { return _heap.empty(); }
+	size_t size()     const { return _heap.size();  }
+	size_t top()      const { DCHECK_F(!empty()); return _heap[0]; }
+	double top_key()  const { DCHECK_F(!empty()); return _keys[_heap[0]]; }
+
+	bool contains(size_t item) const { return _position[item] != kAbsent; }
+
+	// Insert the item, or change its key if it is already in the heap.
+	void update(size_t item, double key)
+	{
+		if (!contains(item)) {
+			_keys[item] = key;
+			_position[item] = _heap.size();
+			_heap.push_back(item);
+			sift_up(_heap.size() - 1);
+		} else {
+			const double old_key = _keys[item];
+			_keys[item] = key;
+			if (key < old_key) {
+				sift_up(_position[item]);
+			} else {
+				sift_down(_position[item]);
+			}
+		}
+	}
+
+	void remove(size_t item)
+	{
+		DCHECK_F(contains(item));
+		const size_t i = _position[item];
+		_position[item] = kAbsent;
+		const size_t last = _heap.back();
+		_heap.pop_back();
+		if (i < _heap.size()) {
+			_heap[i] = last;
+			_position[last] = i;
+			sift_up(i);
+			sift_down(_position[last]);
+		}
+	}
+
+private:
+	static const size_t kAbsent = static_cast<size_t>(-1);
+
+	void sift_up(size_t i)
+	{
+		const size_t item = _heap[i];
+		while (i > 0) {
+			const size_t parent = (i - 1) / 2;
+			if (!(_keys[item] < _keys[_heap[parent]])) { break; }
+			place(i, _heap[parent]);
+			i = parent;
+		}
+		place(i, item);
+	}
+
+	void sift_down(size_t i)
+	{
+		const size_t item = _heap[i];
+		for (;;) {
+			size_t child = 2 * i + 1;
+			if (child >= _heap.size()) { break; }
+			if (child + 1 < _heap.size() && _keys[_heap[child + 1]] < _keys[_heap[child]]) {
+				child += 1;
+			}
+			if (!(_keys[_heap[child]] < _keys[item])) { break; }
+			place(i, _heap[child]);
+			i = child;
+		}
+		place(i, item);
+	}
+
+	void place(size_t i, size_t item)
+	{
+		_heap[i] = item;
+		_position[item] = i;
+	}
+
+	std::vector<size_t> _heap;     // Items, ordered as a binary heap on their keys.
+	std::vector<double> _keys;     // Indexed by item.
+	std::vector<size_t> _position; // Indexed by item: where in _heap it is, or kAbsent.
+};
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+
+// Counts durations in logarithmic buckets: kBucketsPerOctave per doubling from 1 ns up to about 18 minutes,
+// so a percentile is within 10% of the actual value, in a fixed amount of memory.
+class LatencyHistogram
+{
+public:
+	void add(double seconds)
+	{
+		_buckets[bucket(seconds)] += 1;
+		_count += 1;
+		_max = std::max(_max, seconds);
+	}
+
+	void merge(const LatencyHistogram& other)
+	{
+		for (size_t i = 0; i < kNumBuckets; ++i) {
+			_buckets[i] += other._buckets[i];
+		}
+		_count += other._count;
+		_max = std::max(_max, other._max);
+	}
+
+	uint64_t count() const { return _count; }
+	double   max()   const { return _max; }
+
+	// The smallest duration which fraction (0-1) of all durations are at most, rounded up to its bucket. 0 if empty.
+	double percentile(double fraction) const
+	{
+		const double wanted = std::ceil(fraction * _count);
+		uint64_t so_far = 0;
+		for (size_t i = 0; i < kNumBuckets; ++i) {
+			so_far += _buckets[i];
+			if (so_far > 0 && so_far >= wanted) {
+				return std::min(_max, 1e-9 * std::exp2((i + 1.0) / kBucketsPerOctave));
+			}
+		}
+		return _max;
+	}
+
+private:
+	static const size_t kBucketsPerOctave = 8;
+	static const size_t kNumBuckets       = 40 * kBucketsPerOctave;
+
+	static size_t bucket(double seconds)
+	{
+		const double nanoseconds = seconds * 1e9;
+		if (nanoseconds <= 1) { return 0; }
+		return std::min<size_t>(kBucketsPerOctave * std::log2(nanoseconds), kNumBuckets - 1);
+	}
+
+	std::array<uint64_t, kNumBuckets> _buckets{};
+	uint64_t                          _count = 0;
+	double                            _max   = 0;
+};
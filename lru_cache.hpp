@@ -0,0 +1,50 @@
+#pragma once
+
+#include <list>
+#include <unordered_map>
+#include <utility>
+
+// A map which only keeps the capacity most recently used entries.
+template<typename Key, typename Value>
+class LruCache
+{
+public:
+	explicit LruCache(size_t capacity) : _capacity(capacity) {}
+
+	size_t size()     const { return _map.size(); }
+	size_t capacity() const { return _capacity; }
+
+	// Marks the entry as the most recently used. nullptr if there is no such entry.
+	Value* find(const Key& key)
+	{
+		const auto it = _map.find(key);
+		if (it == _map.end()) { return nullptr; }
+		_order.splice(_order.begin(), _order, it->second);
+		return &it->second->second;
+	}
+
+	// Inserts or replaces the entry, evicting the least recently used one if full.
+	Value& insert(const Key& key, Value value)
+	{
+		if (Value* existing = find(key)) {
+			*existing = std::move(value);
+			return *existing;
+		}
+
+		if (_map.size() >= _capacity && !_order.empty()) {
+			_map.erase(_order.back().first);
+			_order.pop_back();
+		}
+
+		_order.emplace_front(key, std::move(value));
+		_map[key] = _order.begin();
+		return _order.front().second;
+	}
+
+private:
+	using Entries = std::list<std::pair<Key, Value>>;
+
+	size_t                                              _capacity;
+	Entries                                             _order; // Most recently used first
+	std::unordered_map<Key, typename Entries::iterator> _map;
+};
@@ -1,6 +1,8 @@
 #if 0
 	# Who needs a makefile? Just run ./main.cpp [arguments]
 	# ./main.cpp clean will clear the build dir.
+	# WFC_WIDE_COLORS=1 ./main.cpp builds with 16-bit color indices, for samples with more than 256 colors.
+	# WFC_BENCH=1 ./main.cpp [arguments] builds and runs the benchmark wfc_bench.bin instead (see kBenchUsage).
 	set -eu
 
 	if [ ! -z ${1+x} ] && [ $1 == "clean" ]; then
@@ -10,15 +12,26 @@
 
 	git submodule update --init --recursive
 
-	mkdir -p build
-
 	CXX=g++
 	CPPFLAGS="--std=c++14 -Wall -Wno-sign-compare -O2 -g -DNDEBUG"
 	LDLIBS="-lstdc++ -lpthread -ldl"
 	OBJECTS=""
+	BUILD_DIR="build"
+	BIN="wfc.bin"
+	if [ "${WFC_WIDE_COLORS:-0}" == "1" ]; then
+		CPPFLAGS="$CPPFLAGS -DWFC_WIDE_COLORS=1"
+		BUILD_DIR="build/wide_colors"
+	fi
+	if [ "${WFC_BENCH:-0}" == "1" ]; then
+		CPPFLAGS="$CPPFLAGS -DWFC_BENCH=1"
+		BUILD_DIR="$BUILD_DIR/bench"
+		BIN="wfc_bench.bin"
+	fi
+
+	mkdir -p $BUILD_DIR
 
 	for source_path in *.cpp; do
-		obj_path="build/${source_path%.cpp}.o"
+		obj_path="$BUILD_DIR/${source_path%.cpp}.o"
 		OBJECTS="$OBJECTS $obj_path"
 		if [ ! -f $obj_path ] || [ $obj_path -ot $source_path ]; then
 			echo "Compiling $source_path to $obj_path..."
@@ -29,25 +42,43 @@
 	done
 
 	echo "Linking..."
-	$CXX $CPPFLAGS $OBJECTS $LDLIBS -o wfc.bin
+	$CXX $CPPFLAGS $OBJECTS $LDLIBS -o $BIN
 
 	# Run it:
 	mkdir -p output
-	./wfc.bin $@
+	./$BIN $@
 	exit
 #endif
 
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
 #include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
 #include <limits>
 #include <memory>
+#include <mutex>
 #include <numeric>
 #include <random>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#if WFC_BENCH && defined(__GLIBC__)
+	#include <malloc.h> // malloc_trim
+#endif
+
 #include <configuru.hpp>
 #include <emilib/irange.hpp>
 #include <emilib/strprintf.hpp>
@@ -59,16 +90,40 @@
 #include <jo_gif.cpp>
 
 #include "arrays.hpp"
+#include "bit_kernels.hpp"
+#include "flat_counter.hpp"
+#include "hash.hpp"
+#include "indexed_heap.hpp"
+#include "latency_histogram.hpp"
+#include "lru_cache.hpp"
+#include "thread_pool.hpp"
+#include "trace.hpp"
 
 const auto kUsage = R"(
-wfc.bin [-h/--help] [--gif] [job=samples.cfg, ...]
+wfc.bin [-h/--help] [--gif] [--threads N] [--jobs N] [--cache DIR] [--stats] [--trace F] [job=samples.cfg, ...]
 	-h/--help   Print this help
 	--gif       Export GIF images of the process
+	--threads N Number of threads to run on (default: one per core)
+	--jobs N    Max number of jobs (models) in memory at once (default: one per thread)
+	--cache DIR Cache the patterns of overlapping models in DIR
+	--stats     Log what the solver did for each job, and write it to output/stats.jsonl
+	--trace F   Write a timeline of the run to F, for chrome://tracing or ui.perfetto.dev
 	file        Jobs to run
 )";
 
 using emilib::irange;
 
+// The job the current thread works on, which LOG_JOB_F starts each message with. We do not use the loguru thread
+// name for this, since the OS cuts thread names short (to 15 characters on Linux) or refuses them.
+std::string& current_job()
+{
+	static thread_local std::string s_job = "main";
+	return s_job;
+}
+
+#define LOG_JOB_F(verbosity_name, format, ...) \
+	LOG_F(verbosity_name, "%-20s| " format, current_job().c_str(), ##__VA_ARGS__)
+
 struct RGBA
 {
 	uint8_t r, g, b, a;
@@ -77,26 +132,42 @@ static_assert(sizeof(RGBA) == 4, "");
 bool operator==(RGBA x, RGBA y) { return x.r == y.r && x.g == y.g && x.b == y.b && x.a == y.a; }
 
 using Bool              = uint8_t; // To avoid problems with vector<bool>
-using ColorIndex        = uint8_t; // tile index or color index. If you have more than 255, don't.
+#if WFC_WIDE_COLORS
+using ColorIndex        = uint16_t; // tile index or color index. Build with -DWFC_WIDE_COLORS=1 for up to 65536 colors.
+#else
+using ColorIndex        = uint8_t; // tile index or color index. If you have more than 256, build with -DWFC_WIDE_COLORS=1.
+#endif
 using Palette           = std::vector<RGBA>;
 using Pattern           = std::vector<ColorIndex>;
-using PatternHash       = uint64_t; // Another representation of a Pattern.
-using PatternPrevalence = std::unordered_map<PatternHash, size_t>;
+using PatternPrevalence = std::vector<std::pair<Pattern, size_t>>; // In the order first seen in the sample.
 using RandomDouble      = std::function<double()>;
-using PatternIndex      = uint16_t;
+using PatternIndex      = uint16_t; // Of a tile. OverlappingModel picks its own, see make_overlapping_model.
+using SupportCount      = uint32_t; // Number of patterns supporting a pattern from one direction.
 
 const auto kInvalidIndex = static_cast<size_t>(-1);
-const auto kInvalidHash = static_cast<PatternHash>(-1);
 
 const bool   kGifSeparatePalette  = true;
 const size_t kGifInterval         =  16; // Save an image every X iterations
+const size_t kGifQueueSize        =   8; // Max frames waiting to be encoded
 const int    kGifDelayCentiSec    =   1;
 const int    kGifEndPauseCentiSec = 200;
 const size_t kUpscale             =   4; // Upscale images before saving
+const size_t kTraceStepInterval   =  64; // With --trace, record every X:th observe and propagate
 
 struct Options
 {
-	bool export_gif = false;
+	bool   export_gif  = false;
+	size_t num_threads = std::max(1u, std::thread::hardware_concurrency());
+	size_t max_jobs    = 0; // 0 = num_threads
+	std::string cache_dir;  // Empty = no model cache
+	FILE*       stats_file = nullptr; // --stats: every job adds a line of JSON. Opened and closed by main.
+	std::string trace_path; // Empty = no --trace
+};
+
+enum class Propagation
+{
+	kSupport, // Count the supporters of each pattern in each cell (AC-4). Fast, but uses a counter per pattern and direction.
+	kMask,    // Intersect the neighbors of a changed cell with the union of precomputed bitmasks. No per-cell state.
 };
 
 enum class Result
@@ -129,18 +200,110 @@ struct PalettedImage
 	}
 };
 
+// The pattern t was removed from the wave at x, y.
+struct Ban
+{
+	int    x, y;
+	size_t t;
+};
+
+// An observation: the pattern t was picked for x, y when the trail had trail_size bans on it.
+struct Decision
+{
+	int    x, y;
+	size_t t;
+	size_t trail_size;
+};
+
 // What actually changes
 struct Output
 {
 	// _width X _height X num_patterns
 	// _wave.get(x, y, t) == is the pattern t possible at x, y?
 	// Starts off true everywhere.
-	Array3D<Bool> _wave;
-	Array2D<Bool> _changes; // _width X _height. Starts off false everywhere.
+	BitArray3D _wave;
+
+	// _width X _height. Has the cell lost patterns since its neighbors were last updated?
+	// Only used by Propagation::kMask.
+	Array2D<Bool> _changed;
+
+	// _width X _height X (num_patterns * num_directions), set up by Model::init_output.
+	// _compatible8/16/32.get(x, y, t * num_directions + d) == how many patterns in direction d of x, y
+	// still agree with pattern t being at x, y. When it reaches zero, t is banned from x, y.
+	// Only one of them is used, the narrowest that all the counts fit in. See fill_compatible.
+	Array3D<uint8_t>      _compatible8;
+	Array3D<uint16_t>     _compatible16;
+	Array3D<uint32_t>     _compatible32;
+
+	// Bans whose consequences for the neighbors have not been propagated yet.
+	std::vector<Ban> _pending;
+
+	// _width X _height. Running totals over the patterns still possible in each cell,
+	// updated on every ban so that the entropy of a cell is cheap to compute.
+	Array2D<size_t> _num_possible;
+	Array2D<double> _sum_weights;
+	Array2D<double> _sum_weight_log_weights;
+
+	// The cells which are not yet decided, keyed by their entropy plus a small tie-breaking bias
+	// (see entropy_key). Indexed by y * _width + x. Filled in by init_entropy_heap.
+	IndexedMinHeap  _entropy_heap;
+	uint64_t        _noise_seed = 0;
+	size_t          _num_observations = 0;
+
+	// Counters of the work done, for wfc_bench and --stats. Including what backtracking later undoes.
+	size_t          _num_bans           = 0;
+	size_t          _num_propagations   = 0; // Calls to Model::propagate by run
+	size_t          _num_cells_visited  = 0; // Neighbors looked at by Model::propagate
+	size_t          _num_contradictions = 0;
+
+	// Cells which have changed since their key in _entropy_heap was last updated.
+	std::vector<size_t> _stale_cells;
+	Array2D<Bool>       _stale;  // _width X _height. Is the cell in _stale_cells?
+
+	// Cells whose wave has changed since the last GIF frame, so that only those are rendered again.
+	// Only tracked once a GifEncoder has taken the first frame (see GifEncoder::add_frame).
+	bool                _track_dirty = false;
+	std::vector<size_t> _dirty_cells;
+	Array2D<Bool>       _dirty;  // _width X _height. Is the cell in _dirty_cells?
+
+	// When backtracking, every ban and observation is recorded so that they can be undone.
+	bool                  _record_trail = false;
+	std::vector<Ban>      _trail;
+	std::vector<Decision> _decisions;
 };
 
 using Image = Array2D<RGBA>;
 
+// Seconds spent in each phase of generating an output. Only measured when asked for (see run),
+// for wfc_bench and --stats.
+struct PhaseTimes
+{
+	double           observe   = 0;
+	double           propagate = 0;
+	double           render    = 0; // Model::image
+	double           encode    = 0; // PNG or GIF
+	LatencyHistogram steps;         // Of each observe + propagate
+};
+
+// Adds the time until it goes out of scope to *seconds, unless seconds is nullptr.
+class ScopedTimer
+{
+public:
+	explicit ScopedTimer(double* seconds) : _seconds(seconds)
+	{
+		if (_seconds) { _start = std::chrono::steady_clock::now(); }
+	}
+
+	~ScopedTimer()
+	{
+		if (_seconds) { *_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - _start).count(); }
+	}
+
+private:
+	double*                               _seconds;
+	std::chrono::steady_clock::time_point _start;
+};
+
 // ----------------------------------------------------------------------------
 
 Image upsample(const Image& image)
@@ -164,48 +327,130 @@ public:
 	size_t              _num_patterns;
 	bool                _periodic_out;
 	size_t              _foundation = kInvalidIndex; // Index of pattern which is at the base, or kInvalidIndex
+	Propagation         _propagation = Propagation::kSupport;
 
 	// The weight of each pattern (e.g. how often that pattern occurs in the sample image).
 	std::vector<double> _pattern_weight; // num_patterns
+	std::vector<double> _weight_log_weight; // num_patterns, w * log(w) of each weight. See init_weights.
+
+	// Call once _pattern_weight is filled in.
+	void init_weights()
+	{
+		_weight_log_weight.clear();
+		for (const auto weight : _pattern_weight) {
+			_weight_log_weight.push_back(weight > 0 ? weight * std::log(weight) : 0.0);
+		}
+	}
 
-	virtual bool propagate(Output* output) const = 0;
+	// Set up the propagation state of a fresh output, where every pattern is still possible.
+	virtual void init_output(Output* output) const = 0;
+	// Propagate all pending bans. Returns Result::kFail as soon as a cell runs out of patterns,
+	// else Result::kUnfinished.
+	virtual Result propagate(Output* output) const = 0;
+	// Undo what propagate did to the support counts for a ban that is being taken back.
+	virtual void restore_supports(Output* output, const Ban& banned) const = 0;
 	virtual bool on_boundary(int x, int y) const = 0;
 	virtual Image image(const Output& output) const = 0;
+	// Render again the pixels of an image (from image()) which depend on the given cells (y * _width + x).
+	virtual void update_image(const Output& output, const std::vector<size_t>& cells, Image* image) const = 0;
 	virtual ~Model()  { }
 };
 
 // ----------------------------------------------------------------------------
 
+// What an OverlappingModel learns from its sample image: the patterns and how they overlap.
+// This only depends on the sample and how the patterns were extracted, so it can be cached on disk.
+// The big arrays point into storage, which is either built by make_pattern_set or a mapped cache file,
+// so that a model loaded from the cache uses the file as is.
+struct PatternSet
+{
+	int                       n = 0;
+	Palette                   palette;
+	std::vector<double>       weights;
+	size_t                    foundation = kInvalidIndex;
+	size_t                    num_patterns = 0;
+	const ColorIndex*         patterns = nullptr; // num_patterns * n * n: the colors of pattern t start at t * n * n
+	// The patterns that agree with t when placed at offset dx, dy are in compressed rows:
+	// propagator_list[propagator_starts[i] .. propagator_starts[i + 1]], i = t * num_offsets + (dx + n - 1) * (2 * n - 1) + dy + n - 1
+	// Each pattern index in the list is pattern_index_size(num_patterns) bytes.
+	const uint32_t*           propagator_starts = nullptr; // num_patterns * num_offsets + 1
+	const void*               propagator_list = nullptr;
+	size_t                    propagator_size = 0;
+	std::shared_ptr<const void> storage; // Owns the arrays above
+};
+
+// 1, 2 or 4 bytes: the fewest that fit an index of any of the patterns.
+size_t pattern_index_size(size_t num_patterns)
+{
+	return num_patterns <= 0x100 ? 1 : num_patterns <= 0x10000 ? 2 : 4;
+}
+
+void write_pattern_index(uint8_t* list, size_t index_size, size_t i, uint32_t index)
+{
+	if      (index_size == 1) { list[i] = index; }
+	else if (index_size == 2) { const uint16_t narrow = index; memcpy(list + 2 * i, &narrow, 2); }
+	else                      { memcpy(list + 4 * i, &index, 4); }
+}
+
+// Index is the type of the pattern indices in the propagator: the smallest that fits the patterns saves a lot of
+// memory on large models. N is the pattern size if known at compile time, so that the loops over the offsets can be
+// unrolled, else 0. See make_overlapping_model.
+template<typename Index, int N>
 class OverlappingModel : public Model
 {
 public:
 	OverlappingModel(
-		const PatternPrevalence& hashed_patterns,
-		const Palette&           palette,
-		int                      n,
-		bool                     periodic_out,
-		size_t                   width,
-		size_t                   height,
-		PatternHash              foundation_pattern);
+		PatternSet  pattern_set,
+		bool        periodic_out,
+		size_t      width,
+		size_t      height,
+		Propagation propagation);
 
-	bool propagate(Output* output) const override;
+	void init_output(Output* output) const override;
+	Result propagate(Output* output) const override;
+	void restore_supports(Output* output, const Ban& banned) const override;
 
 	bool on_boundary(int x, int y) const override
 	{
-		return !_periodic_out && (x + _n > _width || y + _n > _height);
+		return !_periodic_out && (x + n() > _width || y + n() > _height);
 	}
 
 	Image image(const Output& output) const override;
+	void update_image(const Output& output, const std::vector<size_t>& cells, Image* image) const override;
 
 	Graphics graphics(const Output& output) const;
 
 private:
+	// The colors of the patterns which cover the pixel x, y.
+	void add_contributors(const Output& output, int x, int y, std::vector<ColorIndex>* out_contributors) const;
+
+	// The cell at offset dx, dy from x, y, or false if it has no neighbor there.
+	bool neighbor(int x, int y, int dx, int dy, int* out_x, int* out_y) const;
+
+	template<typename Count>
+	Result propagate_supports(Output* output) const;
+	template<typename Count>
+	void restore_counts(Output* output, const Ban& banned) const;
+	Result propagate_masks(Output* output) const;
+
+	// The patterns that agree with t when placed at the given offset, i.e. (dx + n - 1) * (2 * n - 1) + dy + n - 1.
+	auto propagator(size_t t, int offset) const
+	{
+		const size_t i = t * num_offsets() + offset;
+		return emilib::it_range(_propagator_list + _propagator_starts[i], _propagator_list + _propagator_starts[i + 1]);
+	}
+
+	int n()           const { return N > 0 ? N : _n; }
+	int num_offsets() const { return (2 * n() - 1) * (2 * n() - 1); }
+
 	int                       _n;
-	// num_patterns X (2 * n - 1) X (2 * n - 1) X ???
-	// list of other pattern indices that agree on this x/y offset (?)
-	Array3D<std::vector<PatternIndex>> _propagator;
-	std::vector<Pattern>               _patterns;
-	Palette                            _palette;
+	std::shared_ptr<const void> _storage; // See PatternSet
+	const uint32_t*           _propagator_starts;
+	const Index*              _propagator_list;
+	// num_patterns X num_offsets X num_patterns. The same as the propagator, as bits. Only for Propagation::kMask.
+	BitArray3D                _propagator_masks;
+	const ColorIndex*         _patterns; // num_patterns * n * n
+	Palette                   _palette;
 };
 
 // ----------------------------------------------------------------------------
@@ -216,9 +461,12 @@ using TileLoader = std::function<Tile(const std::string& tile_name)>;
 class TileModel : public Model
 {
 public:
-	TileModel(const configuru::Config& config, std::string subset_name, int width, int height, bool periodic, const TileLoader& tile_loader);
+	TileModel(const configuru::Config& config, std::string subset_name, int width, int height, bool periodic,
+	          Propagation propagation, const TileLoader& tile_loader);
 
-	bool propagate(Output* output) const override;
+	void init_output(Output* output) const override;
+	Result propagate(Output* output) const override;
+	void restore_supports(Output* output, const Ban& banned) const override;
 
 	bool on_boundary(int x, int y) const override
 	{
@@ -226,122 +474,203 @@ public:
 	}
 
 	Image image(const Output& output) const override;
+	void update_image(const Output& output, const std::vector<size_t>& cells, Image* image) const override;
 
 private:
-	Array3D<Bool>                  _propagator; // 4 X _num_patterns X _num_patterns
+	// Render the tile of the cell x, y into the image.
+	void render_cell(const Output& output, int x, int y, Image* image) const;
+
+	// The cell which has x1, y1 in direction d, or false if there is none.
+	bool neighbor(int x1, int y1, int d, int* out_x2, int* out_y2) const;
+
+	template<typename Count>
+	Result propagate_supports(Output* output) const;
+	template<typename Count>
+	void restore_counts(Output* output, const Ban& banned) const;
+	Result propagate_masks(Output* output) const;
+
+	BitArray3D                     _propagator; // 4 X _num_patterns X _num_patterns
+	// 4 X _num_patterns. _compatible_tiles.ref(d, t1) == all t2 for which _propagator.get(d, t1, t2).
+	Array2D<std::vector<PatternIndex>> _compatible_tiles;
 	std::vector<std::vector<RGBA>> _tiles;
 	size_t                         _tile_size;
 };
 
 // ----------------------------------------------------------------------------
 
-double calc_sum(const std::vector<double>& a)
+// The Shannon entropy of the weights of the patterns still possible at x, y.
+double entropy(const Output& output, int x, int y)
+{
+	const double sum = output._sum_weights.get(x, y);
+	if (sum <= 0) { return 0; }
+	return std::log(sum) - output._sum_weight_log_weights.get(x, y) / sum;
+}
+
+// The entropy of a cell plus a tie-breaking bias below 1e-6. Among cells of equal entropy, the one
+// which changed the longest ago goes first, with random noise between cells changed in the same step.
+// A purely random per-cell noise would starve cells with unlucky noise while their surroundings
+// get decided, which makes contradictions much more common.
+double entropy_key(const Output& output, size_t cell, int x, int y)
 {
-	return std::accumulate(a.begin(), a.end(), 0.0);
+	// The noise only depends on the seed and the state of the cell, so it is fixed until the cell changes:
+	const uint64_t hash = mix64(output._noise_seed ^ (cell * 0x9E3779B97F4A7C15ull)
+	                            ^ (output._num_possible.get(x, y) * 0xC2B2AE3D27D4EB4Full));
+	const double noise = (hash >> 11) * (1.0 / (1ull << 53)); // [0, 1)
+
+	const double num_cells = output._num_possible.width() * output._num_possible.height();
+	return entropy(output, x, y) + 1e-6 * (output._num_observations + noise) / (num_cells + 1);
 }
 
-// Pick a random index weighted by a
-size_t spin_the_bottle(const std::vector<double>& a, double between_zero_and_one)
+// The entropy of x, y has changed, so its key in the entropy heap needs updating.
+void mark_stale(const Model& model, Output* output, int x, int y)
 {
-	double sum = calc_sum(a);
+	if (!output->_stale.get(x, y)) {
+		output->_stale.set(x, y, true);
+		output->_stale_cells.push_back(y * model._width + x);
+	}
+}
 
-	if (sum == 0.0) {
-		return std::floor(between_zero_and_one * a.size());
+void mark_dirty(const Model& model, Output* output, int x, int y)
+{
+	if (output->_track_dirty && !output->_dirty.get(x, y)) {
+		output->_dirty.set(x, y, true);
+		output->_dirty_cells.push_back(y * model._width + x);
 	}
+}
 
-	double between_zero_and_sum = between_zero_and_one * sum;
+// Remove the pattern t from the wave at x, y. The neighbors are updated by the next Model::propagate.
+// Returns false if that was the last pattern possible at x, y, i.e. on a contradiction.
+bool ban(const Model& model, Output* output, int x, int y, size_t t)
+{
+	DCHECK_F(output->_wave.get(x, y, t));
+	output->_wave.set(x, y, t, false);
+	output->_changed.set(x, y, true);
+	output->_pending.push_back(Ban{x, y, t});
+	output->_num_bans += 1;
 
-	double accumulated = 0;
+	output->_sum_weights.mut_ref(x, y)            -= model._pattern_weight[t];
+	output->_sum_weight_log_weights.mut_ref(x, y) -= model._weight_log_weight[t];
+	const size_t num_possible = --output->_num_possible.mut_ref(x, y);
 
-	for (auto i : irange(a.size())) {
-		accumulated += a[i];
-		if (between_zero_and_sum <= accumulated) {
-			return i;
-		}
+	mark_stale(model, output, x, y);
+	mark_dirty(model, output, x, y);
+
+	if (output->_record_trail) {
+		output->_trail.push_back(Ban{x, y, t});
 	}
 
-	return 0;
+	return num_possible != 0;
 }
 
-PatternHash hash_from_pattern(const Pattern& pattern, size_t palette_size)
+// Put back all bans after the first trail_size ones on the trail.
+void undo_bans(const Model& model, Output* output, size_t trail_size)
 {
-	CHECK_LT_F(std::pow((double)palette_size, (double)pattern.size()),
-	           std::pow(2.0, sizeof(PatternHash) * 8),
-	           "Too large palette (it is %lu) or too large pattern size (it's %.0f)",
-	           palette_size, std::sqrt(pattern.size()));
-	PatternHash result = 0;
-	size_t power = 1;
-	for (const auto i : irange(pattern.size()))
-	{
-		result += pattern[pattern.size() - 1 - i] * power;
-		power *= palette_size;
+	DCHECK_F(output->_pending.empty());
+	while (output->_trail.size() > trail_size) {
+		const Ban banned = output->_trail.back();
+		output->_trail.pop_back();
+
+		output->_wave.set(banned.x, banned.y, banned.t, true);
+		output->_sum_weights.mut_ref(banned.x, banned.y)            += model._pattern_weight[banned.t];
+		output->_sum_weight_log_weights.mut_ref(banned.x, banned.y) += model._weight_log_weight[banned.t];
+		output->_num_possible.mut_ref(banned.x, banned.y)           += 1;
+		mark_stale(model, output, banned.x, banned.y);
+		mark_dirty(model, output, banned.x, banned.y);
+		model.restore_supports(output, banned);
 	}
-	return result;
 }
 
-Pattern pattern_from_hash(const PatternHash hash, int n, size_t palette_size)
-{
-	size_t residue = hash;
-	size_t power = std::pow(palette_size, n * n);
-	Pattern result(n * n);
+// The support counts of the output, in 8, 16 or 32 bits.
+template<typename Count> Array3D<Count>& compatible(Output* output);
+template<> Array3D<uint8_t>&  compatible<uint8_t>(Output* output)  { return output->_compatible8; }
+template<> Array3D<uint16_t>& compatible<uint16_t>(Output* output) { return output->_compatible16; }
+template<> Array3D<uint32_t>& compatible<uint32_t>(Output* output) { return output->_compatible32; }
 
-	for (size_t i = 0; i < result.size(); ++i)
-	{
-		power /= palette_size;
-		size_t count = 0;
+// How many bytes each support count of the output takes.
+size_t support_count_size(const Output& output)
+{
+	if (output._compatible8.size() > 0)  { return 1; }
+	if (output._compatible16.size() > 0) { return 2; }
+	return 4;
+}
 
-		while (residue >= power)
-		{
-			residue -= power;
-			count++;
+template<typename Count>
+void fill_compatible(Output* output, size_t width, size_t height, const std::vector<SupportCount>& initial)
+{
+	auto& counts = compatible<Count>(output);
+	counts = Array3D<Count>(width, height, initial.size(), 0);
+	for (const auto x : irange(width)) {
+		for (const auto y : irange(height)) {
+			for (const auto i : irange(initial.size())) {
+				counts.set(x, y, i, initial[i]);
+			}
 		}
-
-		result[i] = static_cast<ColorIndex>(count);
 	}
-
-	return result;
 }
 
-template<typename Fun>
-Pattern make_pattern(int n, const Fun& fun)
+// Start every cell of the output off with the same support counts, as narrow as they fit.
+// The counts only ever go down from these, and back up to them when bans are undone.
+void fill_compatible(Output* output, size_t width, size_t height, const std::vector<SupportCount>& initial)
 {
-	Pattern result(n * n);
-	for (auto dy : irange(n)) {
-		for (auto dx : irange(n)) {
-			result[dy * n + dx] = fun(dx, dy);
-		}
+	const auto max_count = initial.empty() ? 0 : *std::max_element(initial.begin(), initial.end());
+	output->_compatible8  = {};
+	output->_compatible16 = {};
+	output->_compatible32 = {};
+	if (max_count <= std::numeric_limits<uint8_t>::max()) {
+		fill_compatible<uint8_t>(output, width, height, initial);
+	} else if (max_count <= std::numeric_limits<uint16_t>::max()) {
+		fill_compatible<uint16_t>(output, width, height, initial);
+	} else {
+		fill_compatible<uint32_t>(output, width, height, initial);
 	}
-	return result;
-};
+}
 
 // ----------------------------------------------------------------------------
 
-OverlappingModel::OverlappingModel(
-	const PatternPrevalence& hashed_patterns,
-	const Palette&           palette,
-	int                      n,
-	bool                     periodic_out,
-	size_t                   width,
-	size_t                   height,
-	PatternHash              foundation_pattern)
+// The storage of a PatternSet made by make_pattern_set.
+struct PatternArrays
 {
-	_width        = width;
-	_height       = height;
-	_num_patterns = hashed_patterns.size();
-	_periodic_out = periodic_out;
-	_n            = n;
-	_palette      = palette;
-
-	for (const auto& it : hashed_patterns) {
-		if (it.first == foundation_pattern) {
-			_foundation = _patterns.size();
-		}
+	std::vector<ColorIndex> patterns;
+	std::vector<uint32_t>   propagator_starts;
+	std::vector<uint8_t>    propagator_list;
+};
 
-		_patterns.push_back(pattern_from_hash(it.first, n, _palette.size()));
-		_pattern_weight.push_back(it.second);
+// Decode the extracted patterns and find out which of them agree at each offset.
+// Two patterns agree at an offset if the parts of them that overlap are equal, so for each offset we
+// bucket the patterns on a hash of the part that would overlap, and look up the partners of each pattern
+// in those buckets instead of comparing it against every other pattern. The work is spread over the pool.
+PatternSet make_pattern_set(ThreadPool* pool, const PatternPrevalence& prevalence, const Palette& palette,
+                            int n, size_t foundation)
+{
+	TRACE_SCOPE("make_pattern_set");
+	const auto arrays = std::make_shared<PatternArrays>();
+	PatternSet result;
+	result.n          = n;
+	result.palette    = palette;
+	result.foundation = foundation;
+
+	for (const auto& it : prevalence) {
+		arrays->patterns.insert(arrays->patterns.end(), it.first.begin(), it.first.end());
+		result.weights.push_back(it.second);
 	}
 
-	const auto agrees = [&](const Pattern& p1, const Pattern& p2, int dx, int dy) {
+	const size_t num_patterns = result.weights.size();
+	const int    side         = 2 * n - 1;
+	const int    num_offsets  = side * side;
+	const auto   pattern      = [&](size_t t) { return arrays->patterns.data() + t * n * n; };
+
+	// The part of a pattern which overlaps another pattern placed at offset dx, dy.
+	const auto overlap_hash = [&](const ColorIndex* p, int dx, int dy) {
+		int xmin = dx < 0 ? 0 : dx, xmax = dx < 0 ? dx + n : n;
+		int ymin = dy < 0 ? 0 : dy, ymax = dy < 0 ? dy + n : n;
+		uint64_t hash = kFnvOffsetBasis;
+		for (int y = ymin; y < ymax; ++y) {
+			hash = fnv1a(hash, &p[xmin + n * y], (xmax - xmin) * sizeof(ColorIndex));
+		}
+		return hash;
+	};
+
+	const auto agrees = [&](const ColorIndex* p1, const ColorIndex* p2, int dx, int dy) {
 		int xmin = dx < 0 ? 0 : dx, xmax = dx < 0 ? dx + n : n;
 		int ymin = dy < 0 ? 0 : dy, ymax = dy < 0 ? dy + n : n;
 		for (int y = ymin; y < ymax; ++y) {
@@ -354,152 +683,434 @@ OverlappingModel::OverlappingModel(
 		return true;
 	};
 
-	_propagator = Array3D<std::vector<PatternIndex>>(_num_patterns, 2 * n - 1, 2 * n - 1, {});
-
-	size_t longest_propagator = 0;
-	size_t sum_propagator = 0;
-
-	for (auto t : irange(_num_patterns)) {
-		for (auto x : irange<int>(2 * n - 1)) {
-			for (auto y : irange<int>(2 * n - 1)) {
-				auto& list = _propagator.mut_ref(t, x, y);
-				for (auto t2 : irange(_num_patterns)) {
-					if (agrees(_patterns[t], _patterns[t2], x - n + 1, y - n + 1)) {
-						list.push_back(t2);
+	// buckets[offset][hash] == the patterns t2 (in order) whose part overlapping a pattern at -offset has that hash.
+	std::vector<std::unordered_map<uint64_t, std::vector<uint32_t>>> buckets(num_offsets);
+	ThreadPool::TaskGroup bucketing;
+	for (const auto offset : irange(num_offsets)) {
+		pool->add(&bucketing, [&, offset]() {
+			const int dx = offset / side - n + 1;
+			const int dy = offset % side - n + 1;
+			for (auto t2 : irange(num_patterns)) {
+				buckets[offset][overlap_hash(pattern(t2), -dx, -dy)].push_back(t2);
+			}
+		});
+	}
+	pool->wait(&bucketing);
+
+	// Find the partners of a range of patterns per task, then stitch the rows together in order.
+	// The lists are written in the final index width right away, and each is freed once it is stitched in,
+	// so that there is never more than one extra copy of the propagator.
+	const size_t index_size = pattern_index_size(num_patterns);
+	const size_t num_chunks = std::min(num_patterns, 4 * pool->num_threads());
+	std::vector<std::vector<uint8_t>>      chunk_lists(num_chunks);
+	std::vector<std::vector<uint32_t>>     chunk_row_sizes(num_chunks);
+	ThreadPool::TaskGroup matching;
+	for (const auto chunk : irange(num_chunks)) {
+		pool->add(&matching, [&, chunk]() {
+			auto& list = chunk_lists[chunk];
+			for (size_t t = chunk * num_patterns / num_chunks; t < (chunk + 1) * num_patterns / num_chunks; ++t) {
+				for (const auto offset : irange(num_offsets)) {
+					const int dx = offset / side - n + 1;
+					const int dy = offset % side - n + 1;
+					size_t row_size = 0;
+					const auto bucket = buckets[offset].find(overlap_hash(pattern(t), dx, dy));
+					if (bucket != buckets[offset].end()) {
+						for (const auto t2 : bucket->second) {
+							if (agrees(pattern(t), pattern(t2), dx, dy)) { // In case of hash collisions
+								list.resize(list.size() + index_size);
+								write_pattern_index(list.data(), index_size, list.size() / index_size - 1, t2);
+								row_size += 1;
+							}
+						}
 					}
+					chunk_row_sizes[chunk].push_back(row_size);
 				}
-				list.shrink_to_fit();
-				longest_propagator = std::max(longest_propagator, list.size());
-				sum_propagator += list.size();
 			}
+		});
+	}
+	pool->wait(&matching);
+	buckets = {};
+
+	size_t sum_propagator = 0;
+	for (const auto& list : chunk_lists) {
+		sum_propagator += list.size() / index_size;
+	}
+	CHECK_LE_F(sum_propagator, std::numeric_limits<uint32_t>::max(), "Too large propagator");
+
+	size_t longest_propagator = 0;
+	arrays->propagator_list.reserve(sum_propagator * index_size);
+	arrays->propagator_starts.reserve(num_patterns * num_offsets + 1);
+	arrays->propagator_starts.push_back(0);
+	for (const auto chunk : irange(num_chunks)) {
+		arrays->propagator_list.insert(arrays->propagator_list.end(), chunk_lists[chunk].begin(), chunk_lists[chunk].end());
+		chunk_lists[chunk] = {};
+		for (const auto row_size : chunk_row_sizes[chunk]) {
+			arrays->propagator_starts.push_back(arrays->propagator_starts.back() + row_size);
+			longest_propagator = std::max<size_t>(longest_propagator, row_size);
 		}
 	}
 
-	LOG_F(INFO, "propagator length: mean/max/sum: %.1f, %lu, %lu",
-	    (double)sum_propagator / _propagator.size(), longest_propagator, sum_propagator);
+	LOG_JOB_F(INFO, "propagator length: mean/max/sum: %.1f, %lu, %lu",
+	    (double)sum_propagator / (arrays->propagator_starts.size() - 1), longest_propagator, sum_propagator);
+
+	result.num_patterns      = num_patterns;
+	result.patterns          = arrays->patterns.data();
+	result.propagator_starts = arrays->propagator_starts.data();
+	result.propagator_list   = arrays->propagator_list.data();
+	result.propagator_size   = sum_propagator;
+	result.storage           = arrays;
+	return result;
 }
 
-bool OverlappingModel::propagate(Output* output) const
+template<typename Index, int N>
+OverlappingModel<Index, N>::OverlappingModel(
+	PatternSet  pattern_set,
+	bool        periodic_out,
+	size_t      width,
+	size_t      height,
+	Propagation propagation)
 {
-	bool did_change = false;
+	TRACE_SCOPE("OverlappingModel");
+	const int n = pattern_set.n;
+
+	_width             = width;
+	_height            = height;
+	_num_patterns      = pattern_set.num_patterns;
+	_periodic_out      = periodic_out;
+	_foundation        = pattern_set.foundation;
+	_propagation       = propagation;
+	_n                 = n;
+	CHECK_F(N == 0 || N == n, "Pattern size mismatch: %d vs %d", N, n);
+	_palette           = std::move(pattern_set.palette);
+	_pattern_weight    = std::move(pattern_set.weights);
+	_storage           = std::move(pattern_set.storage);
+	_patterns          = pattern_set.patterns;
+	_propagator_starts = pattern_set.propagator_starts;
+	_propagator_list   = static_cast<const Index*>(pattern_set.propagator_list);
+	init_weights();
+
+	CHECK_EQ_F(pattern_index_size(_num_patterns), sizeof(Index), "Wrong index type for the patterns");
+
+	if (_propagation == Propagation::kMask) {
+		_propagator_masks = BitArray3D(_num_patterns, num_offsets(), _num_patterns, false);
+		for (auto t : irange(_num_patterns)) {
+			for (auto offset : irange(num_offsets())) {
+				for (const auto t2 : propagator(t, offset)) {
+					_propagator_masks.set(t, offset, t2, true);
+				}
+			}
+		}
+	}
+}
 
-	for (int x1 = 0; x1 < _width; ++x1) {
-		for (int y1 = 0; y1 < _height; ++y1) {
-			if (!output->_changes.get(x1, y1)) { continue; }
-			output->_changes.set(x1, y1, false);
+template<typename Index, int N>
+void OverlappingModel<Index, N>::init_output(Output* output) const
+{
+	if (_propagation != Propagation::kSupport) { return; }
 
-			for (int dx = -_n + 1; dx < _n; ++dx) {
-				for (int dy = -_n + 1; dy < _n; ++dy) {
-					auto x2 = x1 + dx;
-					auto y2 = y1 + dy;
+	// Every pattern starts out supported by everything it agrees with:
+	std::vector<SupportCount> initial(_num_patterns * num_offsets());
+	for (auto i : irange(initial.size())) {
+		initial[i] = _propagator_starts[i + 1] - _propagator_starts[i];
+	}
 
-					auto sx = x2;
-					if      (sx <  0)      { sx += _width; }
-					else if (sx >= _width) { sx -= _width; }
+	fill_compatible(output, _width, _height, initial);
+}
 
-					auto sy = y2;
-					if      (sy <  0)       { sy += _height; }
-					else if (sy >= _height) { sy -= _height; }
+template<typename Index, int N>
+bool OverlappingModel<Index, N>::neighbor(int x, int y, int dx, int dy, int* out_x, int* out_y) const
+{
+	auto sx = x + dx;
+	if      (sx <  0)      { sx += _width; }
+	else if (sx >= _width) { sx -= _width; }
 
-					if (!_periodic_out && (sx + _n > _width || sy + _n > _height)) {
-						continue;
-					}
+	auto sy = y + dy;
+	if      (sy <  0)       { sy += _height; }
+	else if (sy >= _height) { sy -= _height; }
 
-					for (int t2 = 0; t2 < _num_patterns; ++t2) {
-						if (!output->_wave.get(sx, sy, t2)) { continue; }
+	if (on_boundary(sx, sy)) { return false; }
 
-						bool can_pattern_fit = false;
+	*out_x = sx;
+	*out_y = sy;
+	return true;
+}
 
-						const auto& prop = _propagator.ref(t2, _n - 1 - dx, _n - 1 - dy);
-						for (const auto& t3 : prop) {
-							if (output->_wave.get(x1, y1, t3)) {
-								can_pattern_fit = true;
-								break;
-							}
-						}
+template<typename Index, int N>
+Result OverlappingModel<Index, N>::propagate(Output* output) const
+{
+	if (_propagation == Propagation::kMask) { return propagate_masks(output); }
+	switch (support_count_size(*output)) {
+		case 1:  return propagate_supports<uint8_t>(output);
+		case 2:  return propagate_supports<uint16_t>(output);
+		default: return propagate_supports<uint32_t>(output);
+	}
+}
 
-						if (!can_pattern_fit) {
-							output->_changes.set(sx, sy, true);
-							output->_wave.set(sx, sy, t2, false);
-							did_change = true;
-						}
+template<typename Index, int N>
+template<typename Count>
+Result OverlappingModel<Index, N>::propagate_supports(Output* output) const
+{
+	auto& counts = compatible<Count>(output);
+
+	// After a contradiction we stop banning. When recording a trail we still finish the support counts
+	// of the pending bans though, so that every ban on the trail can be undone by restore_supports.
+	bool contradiction = false;
+
+	while (!output->_pending.empty()) {
+		const Ban banned = output->_pending.back();
+		output->_pending.pop_back();
+
+		for (int dx = -n() + 1; dx < n(); ++dx) {
+			for (int dy = -n() + 1; dy < n(); ++dy) {
+				if (dx == 0 && dy == 0) { continue; }
+
+				int sx, sy;
+				if (!neighbor(banned.x, banned.y, dx, dy, &sx, &sy)) { continue; }
+				output->_num_cells_visited += 1;
+
+				// The patterns at sx, sy which agreed with the banned pattern have lost one supporter
+				// in the opposite direction:
+				const int offset   = (dx + n() - 1) * (2 * n() - 1) + (dy + n() - 1);
+				const int opposite = num_offsets() - 1 - offset;
+
+				for (const auto t2 : propagator(banned.t, offset)) {
+					auto& count = counts.mut_ref(sx, sy, t2 * num_offsets() + opposite);
+					DCHECK_GT_F(count, 0u);
+					count -= 1;
+					if (count == 0 && !contradiction && output->_wave.get(sx, sy, t2)) {
+						contradiction = !ban(*this, output, sx, sy, t2);
 					}
 				}
 			}
 		}
+
+		if (contradiction && !output->_record_trail) {
+			output->_pending.clear();
+		}
 	}
 
-	return did_change;
+	return contradiction ? Result::kFail : Result::kUnfinished;
 }
 
-Graphics OverlappingModel::graphics(const Output& output) const
+template<typename Index, int N>
+void OverlappingModel<Index, N>::restore_supports(Output* output, const Ban& banned) const
 {
-	Graphics result(_width, _height, {});
-	for (const auto y : irange(_height)) {
-		for (const auto x : irange(_width)) {
-			auto& tile_constributors = result.mut_ref(x, y);
+	if (_propagation != Propagation::kSupport) { return; }
+	switch (support_count_size(*output)) {
+		case 1:  restore_counts<uint8_t>(output, banned);  break;
+		case 2:  restore_counts<uint16_t>(output, banned); break;
+		default: restore_counts<uint32_t>(output, banned); break;
+	}
+}
+
+template<typename Index, int N>
+template<typename Count>
+void OverlappingModel<Index, N>::restore_counts(Output* output, const Ban& banned) const
+{
+	auto& counts = compatible<Count>(output);
+	for (int dx = -n() + 1; dx < n(); ++dx) {
+		for (int dy = -n() + 1; dy < n(); ++dy) {
+			if (dx == 0 && dy == 0) { continue; }
 
-			for (int dy = 0; dy < _n; ++dy) {
-				for (int dx = 0; dx < _n; ++dx) {
-					int sx = x - dx;
-					if (sx < 0) sx += _width;
+			int sx, sy;
+			if (!neighbor(banned.x, banned.y, dx, dy, &sx, &sy)) { continue; }
 
-					int sy = y - dy;
-					if (sy < 0) sy += _height;
+			const int offset   = (dx + n() - 1) * (2 * n() - 1) + (dy + n() - 1);
+			const int opposite = num_offsets() - 1 - offset;
 
-					if (on_boundary(sx, sy)) { continue; }
+			for (const auto t2 : propagator(banned.t, offset)) {
+				counts.mut_ref(sx, sy, t2 * num_offsets() + opposite) += 1;
+			}
+		}
+	}
+}
 
-					for (int t = 0; t < _num_patterns; ++t) {
-						if (output._wave.get(sx, sy, t)) {
-							tile_constributors.push_back(_patterns[t][dx + dy * _n]);
+template<typename Index, int N>
+Result OverlappingModel<Index, N>::propagate_masks(Output* output) const
+{
+	const size_t num_words = output->_wave.words_per_row();
+	const auto&  kernels   = bit_kernels();
+	std::vector<BitArray3D::Word> allowed(num_words);
+
+	while (!output->_pending.empty()) {
+		const Ban banned = output->_pending.back();
+		output->_pending.pop_back();
+
+		// Several bans in the same cell only need one update of the neighbors:
+		if (!output->_changed.get(banned.x, banned.y)) { continue; }
+		output->_changed.set(banned.x, banned.y, false);
+
+		for (int dx = -n() + 1; dx < n(); ++dx) {
+			for (int dy = -n() + 1; dy < n(); ++dy) {
+				if (dx == 0 && dy == 0) { continue; }
+
+				int sx, sy;
+				if (!neighbor(banned.x, banned.y, dx, dy, &sx, &sy)) { continue; }
+				output->_num_cells_visited += 1;
+
+				// The patterns which can fit at sx, sy are those agreeing with any pattern left at banned.x, banned.y:
+				const int offset = (dx + n() - 1) * (2 * n() - 1) + (dy + n() - 1);
+				std::fill(allowed.begin(), allowed.end(), 0);
+				output->_wave.for_each_set(banned.x, banned.y, [&](size_t t) {
+					kernels.or_into(allowed.data(), _propagator_masks.row(t, offset), num_words);
+				});
+
+				const auto wave = output->_wave.row(sx, sy);
+				if (!kernels.any_and_not(wave, allowed.data(), num_words)) { continue; }
+				for (size_t w = 0; w < num_words; ++w) {
+					for (auto removed = wave[w] & ~allowed[w]; removed != 0; removed &= removed - 1) {
+						if (!ban(*this, output, sx, sy, w * BitArray3D::kWordBits + __builtin_ctzll(removed))) {
+							output->_pending.clear();
+							return Result::kFail;
 						}
 					}
 				}
 			}
 		}
 	}
+
+	return Result::kUnfinished;
+}
+
+template<typename Index, int N>
+void OverlappingModel<Index, N>::add_contributors(const Output& output, int x, int y,
+                                                  std::vector<ColorIndex>* out_contributors) const
+{
+	for (int dy = 0; dy < n(); ++dy) {
+		for (int dx = 0; dx < n(); ++dx) {
+			int sx = x - dx;
+			if (sx < 0) sx += _width;
+
+			int sy = y - dy;
+			if (sy < 0) sy += _height;
+
+			if (on_boundary(sx, sy)) { continue; }
+
+			output._wave.for_each_set(sx, sy, [&](size_t t) {
+				out_contributors->push_back(_patterns[t * n() * n() + dx + dy * n()]);
+			});
+		}
+	}
+}
+
+template<typename Index, int N>
+Graphics OverlappingModel<Index, N>::graphics(const Output& output) const
+{
+	Graphics result(_width, _height, {});
+	for (const auto y : irange(_height)) {
+		for (const auto x : irange(_width)) {
+			add_contributors(output, x, y, &result.mut_ref(x, y));
+		}
+	}
 	return result;
 }
 
+// The average color of the tiles contributing to a pixel.
+RGBA blend(const std::vector<ColorIndex>& tile_constributors, const Palette& palette)
+{
+	if (tile_constributors.empty()) {
+		return {0, 0, 0, 255};
+	} else if (tile_constributors.size() == 1) {
+		return palette[tile_constributors[0]];
+	} else {
+		size_t r = 0;
+		size_t g = 0;
+		size_t b = 0;
+		size_t a = 0;
+		for (const auto tile : tile_constributors) {
+			r += palette[tile].r;
+			g += palette[tile].g;
+			b += palette[tile].b;
+			a += palette[tile].a;
+		}
+		r /= tile_constributors.size();
+		g /= tile_constributors.size();
+		b /= tile_constributors.size();
+		a /= tile_constributors.size();
+		return {(uint8_t)r, (uint8_t)g, (uint8_t)b, (uint8_t)a};
+	}
+}
+
 Image image_from_graphics(const Graphics& graphics, const Palette& palette)
 {
 	Image result(graphics.width(), graphics.height(), {0, 0, 0, 0});
 
 	for (const auto y : irange(graphics.height())) {
 		for (const auto x : irange(graphics.width())) {
-			const auto& tile_constributors = graphics.ref(x, y);
-			if (tile_constributors.empty()) {
-				result.set(x, y, {0, 0, 0, 255});
-			} else if (tile_constributors.size() == 1) {
-				result.set(x, y, palette[tile_constributors[0]]);
-			} else {
-				size_t r = 0;
-				size_t g = 0;
-				size_t b = 0;
-				size_t a = 0;
-				for (const auto tile : tile_constributors) {
-					r += palette[tile].r;
-					g += palette[tile].g;
-					b += palette[tile].b;
-					a += palette[tile].a;
-				}
-				r /= tile_constributors.size();
-				g /= tile_constributors.size();
-				b /= tile_constributors.size();
-				a /= tile_constributors.size();
-				result.set(x, y, {(uint8_t)r, (uint8_t)g, (uint8_t)b, (uint8_t)a});
-			}
+			result.set(x, y, blend(graphics.ref(x, y), palette));
 		}
 	}
 
 	return result;
 }
 
-Image OverlappingModel::image(const Output& output) const
+template<typename Index, int N>
+Image OverlappingModel<Index, N>::image(const Output& output) const
 {
+	TRACE_SCOPE("model.image");
 	return upsample(image_from_graphics(graphics(output), _palette));
 }
 
+// A cell contributes to the n X n pixels starting at it.
+template<typename Index, int N>
+void OverlappingModel<Index, N>::update_image(const Output& output, const std::vector<size_t>& cells, Image* image) const
+{
+	TRACE_SCOPE("model.update_image");
+	std::vector<size_t> pixels;
+	for (const auto cell : cells) {
+		const size_t x = cell % _width;
+		const size_t y = cell / _width;
+		for (int dy = 0; dy < n(); ++dy) {
+			for (int dx = 0; dx < n(); ++dx) {
+				pixels.push_back(((y + dy) % _height) * _width + (x + dx) % _width);
+			}
+		}
+	}
+	std::sort(pixels.begin(), pixels.end());
+	pixels.erase(std::unique(pixels.begin(), pixels.end()), pixels.end());
+
+	std::vector<ColorIndex> tile_constributors;
+	for (const auto pixel : pixels) {
+		const size_t x = pixel % _width;
+		const size_t y = pixel / _width;
+		tile_constributors.clear();
+		add_contributors(output, x, y, &tile_constributors);
+		const RGBA color = blend(tile_constributors, _palette);
+		for (const auto uy : irange(kUpscale)) {
+			for (const auto ux : irange(kUpscale)) {
+				image->set(x * kUpscale + ux, y * kUpscale + uy, color);
+			}
+		}
+	}
+}
+
+template<int N>
+std::unique_ptr<Model> make_overlapping_model_n(PatternSet pattern_set, bool periodic_out, size_t width, size_t height,
+                                                Propagation propagation)
+{
+	const size_t index_size = pattern_index_size(pattern_set.num_patterns);
+	if (index_size == sizeof(uint8_t)) {
+		return std::unique_ptr<Model>{new OverlappingModel<uint8_t, N>{std::move(pattern_set), periodic_out, width, height, propagation}};
+	} else if (index_size == sizeof(uint16_t)) {
+		return std::unique_ptr<Model>{new OverlappingModel<uint16_t, N>{std::move(pattern_set), periodic_out, width, height, propagation}};
+	} else {
+		return std::unique_ptr<Model>{new OverlappingModel<uint32_t, N>{std::move(pattern_set), periodic_out, width, height, propagation}};
+	}
+}
+
+// The OverlappingModel with the smallest index type that fits the patterns.
+// Only n = 3, the default, gets its own loops: it solves the samples about 12% faster in wfc_bench than the
+// generic model does, while specializing n = 2 made no measurable difference.
+std::unique_ptr<Model> make_overlapping_model(PatternSet pattern_set, bool periodic_out, size_t width, size_t height,
+                                              Propagation propagation)
+{
+	if (pattern_set.n == 3) {
+		return make_overlapping_model_n<3>(std::move(pattern_set), periodic_out, width, height, propagation);
+	} else {
+		return make_overlapping_model_n<0>(std::move(pattern_set), periodic_out, width, height, propagation);
+	}
+}
+
 // ----------------------------------------------------------------------------
 
 Tile rotate(const Tile& in_tile, const size_t tile_size)
@@ -514,11 +1125,14 @@ Tile rotate(const Tile& in_tile, const size_t tile_size)
 	return out_tile;
 }
 
-TileModel::TileModel(const configuru::Config& config, std::string subset_name, int width, int height, bool periodic_out, const TileLoader& tile_loader)
+TileModel::TileModel(const configuru::Config& config, std::string subset_name, int width, int height, bool periodic_out,
+                     Propagation propagation, const TileLoader& tile_loader)
 {
+	TRACE_SCOPE("TileModel");
 	_width        = width;
 	_height       = height;
 	_periodic_out = periodic_out;
+	_propagation  = propagation;
 
 	_tile_size        = config.get_or("tile_size", 16);
 	const bool unique = config.get_or("unique",    false);
@@ -608,8 +1222,10 @@ TileModel::TileModel(const configuru::Config& config, std::string subset_name, i
 	}
 
 	_num_patterns = action.size();
+	init_weights();
+	CHECK_LE_F(_num_patterns, std::numeric_limits<PatternIndex>::max(), "Too many tiles");
 
-	_propagator = Array3D<Bool>(4, _num_patterns, _num_patterns, false);
+	_propagator = BitArray3D(4, _num_patterns, _num_patterns, false);
 
 	for (const auto& neighbor : config["neighbors"].as_array()) {
 		const auto left  = neighbor["left"];
@@ -644,119 +1260,244 @@ TileModel::TileModel(const configuru::Config& config, std::string subset_name, i
 			_propagator.set(3, t1, t2, _propagator.get(1, t2, t1));
 		}
 	}
+
+	_compatible_tiles = Array2D<std::vector<PatternIndex>>(4, _num_patterns, {});
+	for (int d = 0; d < 4; ++d) {
+		for (int t1 = 0; t1 < _num_patterns; ++t1) {
+			auto& list = _compatible_tiles.mut_ref(d, t1);
+			_propagator.for_each_set(d, t1, [&](size_t t2) { list.push_back(t2); });
+			list.shrink_to_fit();
+		}
+	}
 }
 
-bool TileModel::propagate(Output* output) const
+void TileModel::init_output(Output* output) const
 {
-	bool did_change = false;
+	if (_propagation != Propagation::kSupport) { return; }
+
+	// How many t1 in direction d support each t2 when everything is possible:
+	std::vector<SupportCount> initial(_num_patterns * 4, 0);
+	for (int d = 0; d < 4; ++d) {
+		for (int t1 = 0; t1 < _num_patterns; ++t1) {
+			for (const auto t2 : _compatible_tiles.ref(d, t1)) {
+				initial[t2 * 4 + d] += 1;
+			}
+		}
+	}
 
-	for (int x2 = 0; x2 < _width; ++x2) {
-		for (int y2 = 0; y2 < _height; ++y2) {
-			for (int d = 0; d < 4; ++d) {
-				int x1 = x2, y1 = y2;
-				if (d == 0) {
-					if (x2 == 0) {
-						if (!_periodic_out) { continue; }
-						x1 = _width - 1;
-					} else {
-						x1 = x2 - 1;
-					}
-				} else if (d == 1) {
-					if (y2 == _height - 1) {
-						if (!_periodic_out) { continue; }
-						y1 = 0;
-					} else {
-						y1 = y2 + 1;
-					}
-				} else if (d == 2) {
-					if (x2 == _width - 1) {
-						if (!_periodic_out) { continue; }
-						x1 = 0;
-					} else {
-						x1 = x2 + 1;
-					}
-				} else {
-					if (y2 == 0) {
-						if (!_periodic_out) { continue; }
-						y1 = _height - 1;
-					} else {
-						y1 = y2 - 1;
-					}
-				}
+	fill_compatible(output, _width, _height, initial);
+}
+
+bool TileModel::neighbor(int x1, int y1, int d, int* out_x2, int* out_y2) const
+{
+	int x2 = x1, y2 = y1;
+	if (d == 0) {
+		if (x1 == _width - 1) {
+			if (!_periodic_out) { return false; }
+			x2 = 0;
+		} else {
+			x2 = x1 + 1;
+		}
+	} else if (d == 1) {
+		if (y1 == 0) {
+			if (!_periodic_out) { return false; }
+			y2 = _height - 1;
+		} else {
+			y2 = y1 - 1;
+		}
+	} else if (d == 2) {
+		if (x1 == 0) {
+			if (!_periodic_out) { return false; }
+			x2 = _width - 1;
+		} else {
+			x2 = x1 - 1;
+		}
+	} else {
+		if (y1 == _height - 1) {
+			if (!_periodic_out) { return false; }
+			y2 = 0;
+		} else {
+			y2 = y1 + 1;
+		}
+	}
 
-				if (!output->_changes.get(x1, y1)) { continue; }
+	*out_x2 = x2;
+	*out_y2 = y2;
+	return true;
+}
 
-				for (int t2 = 0; t2 < _num_patterns; ++t2) {
-					if (output->_wave.get(x2, y2, t2)) {
-						bool b = false;
-						for (int t1 = 0; t1 < _num_patterns && !b; ++t1) {
-							if (output->_wave.get(x1, y1, t1)) {
-								b = _propagator.get(d, t1, t2);
-							}
-						}
-						if (!b) {
-							output->_wave.set(x2, y2, t2, false);
-							output->_changes.set(x2, y2, true);
-							did_change = true;
-						}
-					}
+Result TileModel::propagate(Output* output) const
+{
+	if (_propagation == Propagation::kMask) { return propagate_masks(output); }
+	switch (support_count_size(*output)) {
+		case 1:  return propagate_supports<uint8_t>(output);
+		case 2:  return propagate_supports<uint16_t>(output);
+		default: return propagate_supports<uint32_t>(output);
+	}
+}
+
+template<typename Count>
+Result TileModel::propagate_supports(Output* output) const
+{
+	auto& counts = compatible<Count>(output);
+
+	// After a contradiction we stop banning. When recording a trail we still finish the support counts
+	// of the pending bans though, so that every ban on the trail can be undone by restore_supports.
+	bool contradiction = false;
+
+	while (!output->_pending.empty()) {
+		const Ban banned = output->_pending.back();
+		output->_pending.pop_back();
+
+		for (int d = 0; d < 4; ++d) {
+			int x2, y2;
+			if (!neighbor(banned.x, banned.y, d, &x2, &y2)) { continue; }
+			output->_num_cells_visited += 1;
+
+			for (const auto t2 : _compatible_tiles.ref(d, banned.t)) {
+				auto& count = counts.mut_ref(x2, y2, t2 * 4 + d);
+				DCHECK_GT_F(count, 0u);
+				count -= 1;
+				if (count == 0 && !contradiction && output->_wave.get(x2, y2, t2)) {
+					contradiction = !ban(*this, output, x2, y2, t2);
 				}
 			}
 		}
+
+		if (contradiction && !output->_record_trail) {
+			output->_pending.clear();
+		}
 	}
 
-	return did_change;
+	return contradiction ? Result::kFail : Result::kUnfinished;
 }
 
-Image TileModel::image(const Output& output) const
+void TileModel::restore_supports(Output* output, const Ban& banned) const
 {
-	Image result(_width * _tile_size, _height * _tile_size, {});
+	if (_propagation != Propagation::kSupport) { return; }
+	switch (support_count_size(*output)) {
+		case 1:  restore_counts<uint8_t>(output, banned);  break;
+		case 2:  restore_counts<uint16_t>(output, banned); break;
+		default: restore_counts<uint32_t>(output, banned); break;
+	}
+}
 
-	for (int x = 0; x < _width; ++x) {
-		for (int y = 0; y < _height; ++y) {
-			double sum = 0;
-			for (const auto t : irange(_num_patterns)) {
-				if (output._wave.get(x, y, t)) {
-					sum += _pattern_weight[t];
-				}
-			}
+template<typename Count>
+void TileModel::restore_counts(Output* output, const Ban& banned) const
+{
+	auto& counts = compatible<Count>(output);
+	for (int d = 0; d < 4; ++d) {
+		int x2, y2;
+		if (!neighbor(banned.x, banned.y, d, &x2, &y2)) { continue; }
 
-			for (int yt = 0; yt < _tile_size; ++yt) {
-				for (int xt = 0; xt < _tile_size; ++xt) {
-					if (sum == 0) {
-						result.set(x * _tile_size + xt, y * _tile_size + yt, RGBA{0, 0, 0, 255});
-					} else {
-						double r = 0, g = 0, b = 0, a = 0;
-						for (int t = 0; t < _num_patterns; ++t) {
-							if (output._wave.get(x, y, t)) {
-								RGBA c = _tiles[t][xt + yt * _tile_size];
-								r += (double)c.r * _pattern_weight[t] / sum;
-								g += (double)c.g * _pattern_weight[t] / sum;
-								b += (double)c.b * _pattern_weight[t] / sum;
-								a += (double)c.a * _pattern_weight[t] / sum;
-							}
-						}
+		for (const auto t2 : _compatible_tiles.ref(d, banned.t)) {
+			counts.mut_ref(x2, y2, t2 * 4 + d) += 1;
+		}
+	}
+}
 
-						result.set(x * _tile_size + xt, y * _tile_size + yt,
-						           RGBA{(uint8_t)r, (uint8_t)g, (uint8_t)b, (uint8_t)a});
+Result TileModel::propagate_masks(Output* output) const
+{
+	const size_t num_words = output->_wave.words_per_row();
+	const auto&  kernels   = bit_kernels();
+	std::vector<BitArray3D::Word> allowed(num_words);
+
+	while (!output->_pending.empty()) {
+		const Ban banned = output->_pending.back();
+		output->_pending.pop_back();
+
+		// Several bans in the same cell only need one update of the neighbors:
+		if (!output->_changed.get(banned.x, banned.y)) { continue; }
+		output->_changed.set(banned.x, banned.y, false);
+
+		for (int d = 0; d < 4; ++d) {
+			int x2, y2;
+			if (!neighbor(banned.x, banned.y, d, &x2, &y2)) { continue; }
+			output->_num_cells_visited += 1;
+
+			// The tiles which can fit at x2, y2 are those compatible with any tile left at banned.x, banned.y:
+			std::fill(allowed.begin(), allowed.end(), 0);
+			output->_wave.for_each_set(banned.x, banned.y, [&](size_t t1) {
+				kernels.or_into(allowed.data(), _propagator.row(d, t1), num_words);
+			});
+
+			const auto wave = output->_wave.row(x2, y2);
+			if (!kernels.any_and_not(wave, allowed.data(), num_words)) { continue; }
+			for (size_t w = 0; w < num_words; ++w) {
+				for (auto removed = wave[w] & ~allowed[w]; removed != 0; removed &= removed - 1) {
+					if (!ban(*this, output, x2, y2, w * BitArray3D::kWordBits + __builtin_ctzll(removed))) {
+						output->_pending.clear();
+						return Result::kFail;
 					}
 				}
 			}
 		}
 	}
 
-	return result;
+	return Result::kUnfinished;
 }
 
-// ----------------------------------------------------------------------------
-
-PalettedImage load_paletted_image(const std::string& path)
+void TileModel::render_cell(const Output& output, int x, int y, Image* image) const
 {
-	ERROR_CONTEXT("loading sample image", path.c_str());
-	int width, height, comp;
-	RGBA* rgba = reinterpret_cast<RGBA*>(stbi_load(path.c_str(), &width, &height, &comp, 4));
-	CHECK_NOTNULL_F(rgba);
-	const auto num_pixels = width * height;
+	// Not the running total in _sum_weights: its rounding depends on the order of the bans,
+	// and the colors of a cell should only depend on which tiles are left in it.
+	const bool contradiction = output._num_possible.get(x, y) == 0;
+	double sum = 0;
+	output._wave.for_each_set(x, y, [&](size_t t) { sum += _pattern_weight[t]; });
+
+	for (int yt = 0; yt < _tile_size; ++yt) {
+		for (int xt = 0; xt < _tile_size; ++xt) {
+			if (contradiction) {
+				image->set(x * _tile_size + xt, y * _tile_size + yt, RGBA{0, 0, 0, 255});
+			} else {
+				double r = 0, g = 0, b = 0, a = 0;
+				output._wave.for_each_set(x, y, [&](size_t t) {
+					RGBA c = _tiles[t][xt + yt * _tile_size];
+					r += (double)c.r * _pattern_weight[t] / sum;
+					g += (double)c.g * _pattern_weight[t] / sum;
+					b += (double)c.b * _pattern_weight[t] / sum;
+					a += (double)c.a * _pattern_weight[t] / sum;
+				});
+
+				image->set(x * _tile_size + xt, y * _tile_size + yt,
+				           RGBA{(uint8_t)r, (uint8_t)g, (uint8_t)b, (uint8_t)a});
+			}
+		}
+	}
+}
+
+Image TileModel::image(const Output& output) const
+{
+	TRACE_SCOPE("model.image");
+	Image result(_width * _tile_size, _height * _tile_size, {});
+
+	for (int x = 0; x < _width; ++x) {
+		for (int y = 0; y < _height; ++y) {
+			render_cell(output, x, y, &result);
+		}
+	}
+
+	return result;
+}
+
+void TileModel::update_image(const Output& output, const std::vector<size_t>& cells, Image* image) const
+{
+	TRACE_SCOPE("model.update_image");
+	for (const auto cell : cells) {
+		render_cell(output, cell % _width, cell / _width, image);
+	}
+}
+
+// ----------------------------------------------------------------------------
+
+PalettedImage load_paletted_image(const std::string& path)
+{
+	TRACE_SCOPE("load_paletted_image", path);
+	ERROR_CONTEXT("loading sample image", path.c_str());
+	int width, height, comp;
+	RGBA* rgba = reinterpret_cast<RGBA*>(stbi_load(path.c_str(), &width, &height, &comp, 4));
+	CHECK_NOTNULL_F(rgba);
+	const auto num_pixels = width * height;
 
 	// Fix issues with stbi_load:
 	if (comp == 1) {
@@ -779,15 +1520,22 @@ PalettedImage load_paletted_image(const std::string& path)
 
 	std::vector<RGBA> palette;
 	std::vector<ColorIndex> data;
+	data.reserve(num_pixels);
+	std::unordered_map<uint32_t, ColorIndex> index_from_color; // Keyed by the packed RGBA
 
 	for (const auto pixel_idx : irange(num_pixels)) {
 		const RGBA color = rgba[pixel_idx];
-		const auto color_idx = std::find(palette.begin(), palette.end(), color) - palette.begin();
-		if (color_idx == palette.size()) {
-			CHECK_LT_F(palette.size(), MAX_COLORS, "Too many colors in image");
+		uint32_t packed;
+		memcpy(&packed, &color, sizeof(packed));
+		const auto it = index_from_color.find(packed);
+		if (it != index_from_color.end()) {
+			data.push_back(it->second);
+		} else {
+			CHECK_LT_F(palette.size(), MAX_COLORS, "Too many colors in image. Build with -DWFC_WIDE_COLORS=1 for more.");
+			index_from_color.emplace(packed, palette.size());
+			data.push_back(palette.size());
 			palette.push_back(color);
 		}
-		data.push_back(color_idx);
 	}
 
 	stbi_image_free(rgba);
@@ -800,68 +1548,91 @@ PalettedImage load_paletted_image(const std::string& path)
 }
 
 // n = side of the pattern, e.g. 3.
+// Where the elements of the 8 symmetries of an n X n pattern come from:
+// element i of symmetry k of pattern p is p[permutations[k][i]].
+std::array<std::vector<int>, 8> symmetry_permutations(int n)
+{
+	const auto remap = [n](const std::vector<int>& p, bool rotate) {
+		std::vector<int> result(n * n);
+		for (int y = 0; y < n; ++y) {
+			for (int x = 0; x < n; ++x) {
+				result[y * n + x] = rotate ? p[n - 1 - y + x * n] : p[n - 1 - x + y * n];
+			}
+		}
+		return result;
+	};
+
+	std::array<std::vector<int>, 8> ps;
+	ps[0].resize(n * n);
+	std::iota(ps[0].begin(), ps[0].end(), 0);
+	ps[1] = remap(ps[0], false);
+	ps[2] = remap(ps[0], true);
+	ps[3] = remap(ps[2], false);
+	ps[4] = remap(ps[2], true);
+	ps[5] = remap(ps[4], false);
+	ps[6] = remap(ps[4], true);
+	ps[7] = remap(ps[6], false);
+	return ps;
+}
+
 PatternPrevalence extract_patterns(
 	const PalettedImage& sample, int n, bool periodic_in, size_t symmetry,
-	PatternHash* out_lowest_pattern)
+	size_t* out_lowest_pattern)
 {
+	TRACE_SCOPE("extract_patterns");
 	CHECK_LE_F(n, sample.width);
 	CHECK_LE_F(n, sample.height);
 
-	const auto pattern_from_sample = [&](size_t x, size_t y) {
-		return make_pattern(n, [&](size_t dx, size_t dy){ return sample.at_wrapped(x + dx, y + dy); });
-	};
-	const auto rotate  = [&](const Pattern& p){ return make_pattern(n, [&](size_t x, size_t y){ return p[n - 1 - y + x * n]; }); };
-	const auto reflect = [&](const Pattern& p){ return make_pattern(n, [&](size_t x, size_t y){ return p[n - 1 - x + y * n]; }); };
+	const size_t pattern_size = n * n;
+	const auto permutations = symmetry_permutations(n);
+	symmetry = std::min<size_t>(symmetry, permutations.size());
 
-	PatternPrevalence patterns;
+	FlatCounter counter(pattern_size * sizeof(ColorIndex)); // Keyed by the raw bytes of the patterns
+	Pattern window(pattern_size);
+	Pattern variant(pattern_size);
 
 	for (size_t y : irange(periodic_in ? sample.height : sample.height - n + 1)) {
 		for (size_t x : irange(periodic_in ? sample.width : sample.width - n + 1)) {
-			std::array<Pattern, 8> ps;
-			ps[0] = pattern_from_sample(x, y);
-			ps[1] = reflect(ps[0]);
-			ps[2] = rotate(ps[0]);
-			ps[3] = reflect(ps[2]);
-			ps[4] = rotate(ps[2]);
-			ps[5] = reflect(ps[4]);
-			ps[6] = rotate(ps[4]);
-			ps[7] = reflect(ps[6]);
-
-			for (int k = 0; k < symmetry; ++k) {
-				auto hash = hash_from_pattern(ps[k], sample.palette.size());
-				patterns[hash] += 1;
+			for (int dy = 0; dy < n; ++dy) {
+				for (int dx = 0; dx < n; ++dx) {
+					window[dy * n + dx] = sample.at_wrapped(x + dx, y + dy);
+				}
+			}
+
+			for (size_t k = 0; k < symmetry; ++k) {
+				const auto& permutation = permutations[k];
+				for (size_t i = 0; i < pattern_size; ++i) {
+					variant[i] = window[permutation[i]];
+				}
+				const size_t index = counter.add(variant.data());
 				if (out_lowest_pattern && y == sample.height - 1) {
-					*out_lowest_pattern = hash;
+					*out_lowest_pattern = index;
 				}
 			}
 		}
 	}
 
+	PatternPrevalence patterns;
+	for (size_t index = 0; index < counter.size(); ++index) {
+		const auto key = reinterpret_cast<const ColorIndex*>(counter.key(index));
+		patterns.emplace_back(Pattern(key, key + pattern_size), counter.count(index));
+	}
 	return patterns;
 }
 
-Result find_lowest_entropy(const Model& model, const Output& output, RandomDouble& random_double,
-                           int* argminx, int* argminy)
+// Give each cell its tie-breaking noise and put all undecided cells in the (empty) entropy heap.
+// Returns Result::kFail if some cell is already without patterns.
+Result init_entropy_heap(const Model& model, Output* output, RandomDouble& random_double)
 {
-	// We actually calculate exp(entropy), i.e. the sum of the weights of the possible patterns
-
-	double min = std::numeric_limits<double>::infinity();
+	output->_noise_seed = static_cast<uint64_t>(random_double() * 9007199254740992.0); // 2^53
 
-	for (int x = 0; x < model._width; ++x) {
-		for (int y = 0; y < model._height; ++y) {
+	for (int y = 0; y < model._height; ++y) {
+		for (int x = 0; x < model._width; ++x) {
 			if (model.on_boundary(x, y)) { continue; }
 
-			size_t num_superimposed = 0;
-			double entropy = 0;
-
-			for (int t = 0; t < model._num_patterns; ++t) {
-				if (output._wave.get(x, y, t)) {
-					num_superimposed += 1;
-					entropy += model._pattern_weight[t];
-				}
-			}
+			const size_t num_superimposed = output->_num_possible.get(x, y);
 
-			if (entropy == 0 || num_superimposed == 0) {
+			if (num_superimposed == 0) {
 				return Result::kFail;
 			}
 
@@ -869,65 +1640,137 @@ Result find_lowest_entropy(const Model& model, const Output& output, RandomDoubl
 				continue; // Already frozen
 			}
 
-			// Add a tie-breaking bias:
-			const double noise = 0.5 * random_double();
-			entropy += noise;
+			const size_t cell = y * model._width + x;
+			output->_entropy_heap.update(cell, entropy_key(*output, cell, x, y));
+		}
+	}
+
+	return Result::kUnfinished;
+}
 
-			if (entropy < min) {
-				min = entropy;
-				*argminx = x;
-				*argminy = y;
-			}
+Result find_lowest_entropy(const Model& model, Output* output, int* argminx, int* argminy)
+{
+	// Bring the heap up to date with the bans since the last observation:
+	for (const auto cell : output->_stale_cells) {
+		const int x = cell % model._width;
+		const int y = cell / model._width;
+		output->_stale.set(x, y, false);
+		if (model.on_boundary(x, y)) { continue; }
+
+		if (output->_num_possible.get(x, y) > 1) {
+			output->_entropy_heap.update(cell, entropy_key(*output, cell, x, y)); // Re-inserted if backtracked
+		} else if (output->_entropy_heap.contains(cell)) {
+			output->_entropy_heap.remove(cell); // Decided
 		}
 	}
+	output->_stale_cells.clear();
 
-	if (min == std::numeric_limits<double>::infinity()) {
+	if (output->_entropy_heap.empty()) {
 		return Result::kSuccess;
-	} else {
-		return Result::kUnfinished;
 	}
+
+	const size_t cell = output->_entropy_heap.top();
+	*argminx = cell % model._width;
+	*argminy = cell / model._width;
+	return Result::kUnfinished;
+}
+
+// Pick one of the patterns still possible at x, y, weighted by their weights.
+size_t pick_pattern(const Model& model, const Output& output, int x, int y, double between_zero_and_one)
+{
+	const double sum = output._sum_weights.get(x, y);
+
+	if (sum <= 0) {
+		size_t skip = std::floor(between_zero_and_one * output._num_possible.get(x, y));
+		return output._wave.find_set_if(x, y, [&](size_t) { return skip-- == 0; });
+	}
+
+	// sum is a running total, so it may be a hair off from the actual sum of the weights left.
+	// If we run past the end, we take the last pattern.
+	double remaining = between_zero_and_one * sum;
+	size_t last = kInvalidIndex;
+	const size_t picked = output._wave.find_set_if(x, y, [&](size_t t) {
+		last = t;
+		remaining -= model._pattern_weight[t];
+		return remaining <= 0;
+	});
+	return picked != model._num_patterns ? picked : last;
 }
 
 Result observe(const Model& model, Output* output, RandomDouble& random_double)
 {
 	int argminx, argminy;
-	const auto result = find_lowest_entropy(model, *output, random_double, &argminx, &argminy);
+	const auto result = find_lowest_entropy(model, output, &argminx, &argminy);
 	if (result != Result::kUnfinished) { return result; }
+	output->_num_observations += 1;
 
-	std::vector<double> distribution(model._num_patterns);
-	for (int t = 0; t < model._num_patterns; ++t) {
-		distribution[t] = output->_wave.get(argminx, argminy, t) ? model._pattern_weight[t] : 0;
+	const size_t r = pick_pattern(model, *output, argminx, argminy, random_double());
+	if (output->_record_trail) {
+		output->_decisions.push_back(Decision{argminx, argminy, r, output->_trail.size()});
 	}
-	size_t r = spin_the_bottle(std::move(distribution), random_double());
-	for (int t = 0; t < model._num_patterns; ++t) {
-		output->_wave.set(argminx, argminy, t, t == r);
-	}
-	output->_changes.set(argminx, argminy, true);
+	output->_wave.for_each_set(argminx, argminy, [&](size_t t) {
+		if (t != r) {
+			ban(model, output, argminx, argminy, t);
+		}
+	});
 
 	return Result::kUnfinished;
 }
 
+// Take back the latest observation and rule out the pattern it picked, then propagate that.
+// If that contradicts too, go further back. Returns Result::kFail once there are no observations
+// left to take back, or no backtracks left to spend.
+Result backtrack(const Model& model, Output* output, size_t* backtracks_left)
+{
+	while (!output->_decisions.empty() && *backtracks_left > 0) {
+		*backtracks_left -= 1;
+		const Decision decision = output->_decisions.back();
+		output->_decisions.pop_back();
+		undo_bans(model, output, decision.trail_size);
+
+		const bool still_possible = ban(model, output, decision.x, decision.y, decision.t);
+		output->_num_propagations += 1;
+		if (model.propagate(output) != Result::kFail && still_possible) {
+			return Result::kUnfinished;
+		}
+		output->_num_contradictions += 1;
+	}
+	output->_pending.clear();
+	return Result::kFail;
+}
+
 Output create_output(const Model& model)
 {
+	TRACE_SCOPE("create_output");
 	Output output;
-	output._wave = Array3D<Bool>(model._width, model._height, model._num_patterns, true);
-	output._changes = Array2D<Bool>(model._width, model._height, false);
+	output._wave = BitArray3D(model._width, model._height, model._num_patterns, true);
+	output._changed = Array2D<Bool>(model._width, model._height, false);
+	model.init_output(&output);
+
+	const double sum_weights = std::accumulate(model._pattern_weight.begin(), model._pattern_weight.end(), 0.0);
+	const double sum_weight_log_weights = std::accumulate(model._weight_log_weight.begin(), model._weight_log_weight.end(), 0.0);
+	output._num_possible           = Array2D<size_t>(model._width, model._height, model._num_patterns);
+	output._sum_weights            = Array2D<double>(model._width, model._height, sum_weights);
+	output._sum_weight_log_weights = Array2D<double>(model._width, model._height, sum_weight_log_weights);
+	output._entropy_heap           = IndexedMinHeap(model._width * model._height);
+	output._stale                  = Array2D<Bool>(model._width, model._height, false);
 
 	if (model._foundation != kInvalidIndex) {
 		for (const auto x : irange(model._width)) {
 			for (const auto t : irange(model._num_patterns)) {
-				if (t != model._foundation) {
-					output._wave.set(x, model._height - 1, t, false);
+				if (t != model._foundation && output._wave.get(x, model._height - 1, t)) {
+					ban(model, &output, x, model._height - 1, t);
 				}
 			}
-			output._changes.set(x, model._height - 1, true);
 
 			for (const auto y : irange(model._height - 1)) {
-				output._wave.set(x, y, model._foundation, false);
-				output._changes.set(x, y, true);
+				if (output._wave.get(x, y, model._foundation)) {
+					ban(model, &output, x, y, model._foundation);
+				}
 			}
 
-			while (model.propagate(&output));
+			// A contradiction leaves a cell without patterns, which init_entropy_heap reports when run starts.
+			if (model.propagate(&output) == Result::kFail) { break; }
 		}
 	}
 
@@ -947,114 +1790,824 @@ Image scroll_diagonally(const Image& image)
 	return result;
 }
 
-Result run(Output* output, const Model& model, size_t seed, size_t limit, jo_gif_t* gif_out)
+// Renders and encodes the frames of a GIF on a thread of its own. The first frame is a copy of the wave, and after
+// that only the cells which changed since the frame before are sent, and rendered into the previous image again
+// (see Output::_dirty_cells). So the cost of a frame for the solver and for rendering scales with what changed.
+// When kGifQueueSize frames are waiting, add_frame blocks until one is done, which bounds the memory used.
+// The GIF is finished when the GifEncoder is destroyed.
+class GifEncoder
+{
+public:
+	GifEncoder(const Model& model, std::string path)
+		: _model(model), _path(std::move(path)), _thread([this]() { encode_frames(); }) {}
+
+	~GifEncoder()
+	{
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_done = true;
+		}
+		_cv.notify_all();
+		_thread.join();
+		if (_started) {
+			jo_gif_end(&_gif);
+		}
+	}
+
+	GifEncoder(const GifEncoder&) = delete;
+	GifEncoder& operator=(const GifEncoder&) = delete;
+
+	// Show the output as it is now for delay_centisec. With scroll, follow it by frames scrolling it diagonally.
+	// Starts the tracking of the changed cells of the output.
+	void add_frame(Output* output, int delay_centisec, bool scroll)
+	{
+		Frame frame;
+		frame.delay_centisec = delay_centisec;
+		frame.scroll         = scroll;
+
+		if (!output->_track_dirty) {
+			frame.snapshot._wave         = output->_wave; // All that Model::image looks at
+			frame.snapshot._num_possible = output->_num_possible;
+			output->_track_dirty = true;
+			output->_dirty = Array2D<Bool>(_model._width, _model._height, false);
+			output->_dirty_cells.clear();
+		} else {
+			const size_t words_per_row = output->_wave.words_per_row();
+			for (const auto cell : output->_dirty_cells) {
+				const size_t x = cell % _model._width;
+				const size_t y = cell / _model._width;
+				const auto row = output->_wave.row(x, y);
+				frame.rows.insert(frame.rows.end(), row, row + words_per_row);
+				frame.num_possible.push_back(output->_num_possible.get(x, y));
+				output->_dirty.set(x, y, false);
+			}
+			frame.cells.swap(output->_dirty_cells);
+		}
+
+		std::unique_lock<std::mutex> lock(_mutex);
+		_cv.wait(lock, [this]() { return _queue.size() < kGifQueueSize; });
+		_queue.push_back(std::move(frame));
+		lock.unlock();
+		_cv.notify_all();
+	}
+
+private:
+	struct Frame
+	{
+		Output                        snapshot;     // Of the whole wave, for the first frame
+		std::vector<size_t>           cells;        // Else the cells which changed (y * width + x)
+		std::vector<BitArray3D::Word> rows;         // The wave of each of those cells
+		std::vector<size_t>           num_possible; // Of each of those cells
+		int                           delay_centisec;
+		bool                          scroll;
+	};
+
+	void encode_frames()
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		for (;;) {
+			_cv.wait(lock, [this]() { return !_queue.empty() || _done; });
+			if (_queue.empty()) { return; }
+			Frame frame = std::move(_queue.front());
+			_queue.pop_front();
+			lock.unlock();
+			_cv.notify_all(); // There is room in the queue
+
+			encode(frame);
+			lock.lock();
+		}
+	}
+
+	void encode(Frame& frame)
+	{
+		if (!_started) {
+			_state = std::move(frame.snapshot);
+			_image = _model.image(_state);
+			const int gif_palette_size = 255; // TODO
+			_gif = jo_gif_start(_path.c_str(), _image.width(), _image.height(), 0, gif_palette_size);
+			_started = true;
+		} else {
+			const size_t words_per_row = _state._wave.words_per_row();
+			for (size_t i = 0; i < frame.cells.size(); ++i) {
+				const size_t x = frame.cells[i] % _model._width;
+				const size_t y = frame.cells[i] / _model._width;
+				std::copy_n(&frame.rows[i * words_per_row], words_per_row, _state._wave.mut_row(x, y));
+				_state._num_possible.set(x, y, frame.num_possible[i]);
+			}
+			_model.update_image(_state, frame.cells, &_image);
+		}
+
+		TRACE_SCOPE("jo_gif_frame");
+		jo_gif_frame(&_gif, (uint8_t*)_image.data(), frame.delay_centisec, kGifSeparatePalette); // Only reads it
+		if (frame.scroll) {
+			auto image = _image;
+			for (size_t i = 0; i < _model._width; ++i) {
+				image = scroll_diagonally(image);
+				jo_gif_frame(&_gif, (uint8_t*)image.data(), kGifDelayCentiSec, kGifSeparatePalette);
+			}
+		}
+	}
+
+	const Model&            _model;
+	std::string             _path;
+	jo_gif_t                _gif;
+	bool                    _started = false; // On the first frame, when we know the size of the images
+	Output                  _state;           // The wave, weight sums and pattern counts as of the last frame
+	Image                   _image;           // The last frame
+	std::mutex              _mutex;
+	std::condition_variable _cv;
+	std::deque<Frame>       _queue;
+	bool                    _done = false;
+	std::thread             _thread; // Last, so that everything else is set up before it starts
+};
+
+// With backtracks == 0 we give up on the first contradiction, else we backtrack up to that many times.
+// If cancel is set (by another thread) we stop before the next observation and return Result::kUnfinished.
+// If times is set, the time spent in each phase is added to it (except rendering and encoding GIF frames,
+// which gif_out does on its own thread).
+Result run(Output* output, const Model& model, size_t seed, size_t limit, size_t backtracks,
+           const std::atomic<bool>* cancel, GifEncoder* gif_out, PhaseTimes* times)
 {
 	std::mt19937 gen(seed);
 	std::uniform_real_distribution<double> dis(0.0, 1.0);
 	RandomDouble random_double = [&]() { return dis(gen); };
 
+	if (init_entropy_heap(model, output, random_double) == Result::kFail) {
+		LOG_JOB_F(INFO, "fail before the first iteration");
+		return Result::kFail;
+	}
+
+	output->_record_trail = backtracks > 0;
+	size_t backtracks_left = backtracks;
+
 	for (size_t l = 0; l < limit || limit == 0; ++l) {
-		Result result = observe(model, output, random_double);
+		if (cancel && cancel->load(std::memory_order_relaxed)) {
+			LOG_JOB_F(INFO, "Cancelled after %lu iterations", l);
+			return Result::kUnfinished;
+		}
+
+		const double step_start = times ? times->observe + times->propagate : 0.0;
+		const bool   trace_step = l % kTraceStepInterval == 0;
+		Result result;
+		{
+			TRACE_SCOPE("observe", "", trace_step);
+			ScopedTimer timer(times ? &times->observe : nullptr);
+			result = observe(model, output, random_double);
+		}
 
 		if (gif_out && l % kGifInterval == 0) {
-			const auto image = model.image(*output);
-			jo_gif_frame(gif_out, (uint8_t*)image.data(), kGifDelayCentiSec, kGifSeparatePalette);
+			gif_out->add_frame(output, kGifDelayCentiSec, false);
+		}
+
+		{
+			TRACE_SCOPE("propagate", "", trace_step);
+			ScopedTimer timer(times ? &times->propagate : nullptr);
+			if (result == Result::kUnfinished) {
+				output->_num_propagations += 1;
+				result = model.propagate(output);
+			}
+
+			if (result == Result::kFail) {
+				output->_num_contradictions += 1;
+				if (output->_record_trail) {
+					result = backtrack(model, output, &backtracks_left);
+				}
+			}
+		}
+
+		if (times) {
+			times->steps.add(times->observe + times->propagate - step_start);
 		}
 
 		if (result != Result::kUnfinished) {
 			if (gif_out) {
-				// Pause on the last image:
-				auto image = model.image(*output);
-				jo_gif_frame(gif_out, (uint8_t*)image.data(), kGifEndPauseCentiSec, kGifSeparatePalette);
-
-				if (model._periodic_out) {
-					// Scroll the image diagonally:
-					for (size_t i = 0; i < model._width; ++i) {
-						image = scroll_diagonally(image);
-						jo_gif_frame(gif_out, (uint8_t*)image.data(), kGifDelayCentiSec, kGifSeparatePalette);
-					}
-				}
+				// Pause on the last image, then scroll it diagonally:
+				gif_out->add_frame(output, kGifEndPauseCentiSec, model._periodic_out);
 			}
 
-			LOG_F(INFO, "%s after %lu iterations", result2str(result), l);
+			LOG_JOB_F(INFO, "%s after %lu iterations (%lu backtracks)", result2str(result), l, backtracks - backtracks_left);
 			return result;
 		}
-		while (model.propagate(output));
 	}
 
-	LOG_F(INFO, "Unfinished after %lu iterations", limit);
+	LOG_JOB_F(INFO, "Unfinished after %lu iterations", limit);
 	return Result::kUnfinished;
 }
 
-void run_and_write(const Options& options, const std::string& name, const configuru::Config& config, const Model& model)
+// The seed of an attempt only depends on which attempt it is, so the output does not depend on the number of threads.
+size_t attempt_seed(const std::string& name, size_t screenshot, size_t attempt)
+{
+	const uint64_t hash = fnv1a(kFnvOffsetBasis, name.data(), name.size());
+	return mix64(hash ^ (screenshot * 0x9E3779B97F4A7C15ull) ^ (attempt * 0xC2B2AE3D27D4EB4Full));
+}
+
+Result run_attempt(const Options& options, const std::string& name, const Model& model, size_t screenshot,
+                   size_t attempt, size_t limit, size_t backtracks, const std::atomic<bool>* cancel, Output* output,
+                   PhaseTimes* times)
 {
+	TRACE_SCOPE("run_attempt", emilib::strprintf("%s %lu, attempt %lu", name.c_str(), screenshot, attempt));
+	const size_t seed = attempt_seed(name, screenshot, attempt);
+
+	*output = create_output(model);
+
+	std::unique_ptr<GifEncoder> gif;
+	if (options.export_gif) {
+		gif.reset(new GifEncoder(model, emilib::strprintf("output/%s_%lu.gif", name.c_str(), screenshot)));
+	}
+
+	return run(output, model, seed, limit, backtracks, cancel, gif.get(), times);
+}
+
+// What the solver did for a job, over all its attempts. Only collected with --stats.
+struct JobStats
+{
+	std::mutex mutex; // The attempts run in parallel
+	size_t     attempts       = 0;
+	size_t     observations   = 0;
+	size_t     propagations   = 0;
+	size_t     cells_visited  = 0;
+	size_t     bans           = 0;
+	size_t     contradictions = 0;
+	PhaseTimes times;
+
+	void add(const Output& output, const PhaseTimes& attempt_times)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		attempts       += 1;
+		observations   += output._num_observations;
+		propagations   += output._num_propagations;
+		cells_visited  += output._num_cells_visited;
+		bans           += output._num_bans;
+		contradictions += output._num_contradictions;
+		times.observe   += attempt_times.observe;
+		times.propagate += attempt_times.propagate;
+		times.steps.merge(attempt_times.steps);
+	}
+};
+
+// Log a summary line and write it as a line of JSON to file.
+void write_stats(FILE* file, const std::string& name, const JobStats& stats)
+{
+	const auto& steps = stats.times.steps;
+	LOG_JOB_F(INFO, "%lu attempts, %lu observations, %lu propagations, %lu cells visited, %lu bans, "
+	      "%lu contradictions, observe+propagate step p50/p90/p99/max: %.1f/%.1f/%.1f/%.1f us",
+	      stats.attempts, stats.observations, stats.propagations, stats.cells_visited, stats.bans,
+	      stats.contradictions, 1e6 * steps.percentile(0.5), 1e6 * steps.percentile(0.9), 1e6 * steps.percentile(0.99),
+	      1e6 * steps.max());
+
+	const auto line = emilib::strprintf(
+		"{\"name\": \"%s\", \"attempts\": %lu, \"observations\": %lu, \"propagations\": %lu, \"cells_visited\": %lu, "
+		"\"bans\": %lu, \"contradictions\": %lu, \"observe_s\": %.6f, \"propagate_s\": %.6f, "
+		"\"step_us\": {\"count\": %lu, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f}}\n",
+		json_escaped(name).c_str(), stats.attempts, stats.observations, stats.propagations, stats.cells_visited,
+		stats.bans, stats.contradictions, stats.times.observe, stats.times.propagate, (size_t)steps.count(),
+		1e6 * steps.percentile(0.5), 1e6 * steps.percentile(0.9), 1e6 * steps.percentile(0.99), 1e6 * steps.max());
+
+	fputs(line.c_str(), file); // Locks the file, so the lines of jobs finishing in parallel don't interleave
+}
+
+// The screenshots are run in parallel on the pool, sharing the model.
+// With race > 1, that many attempts of each screenshot are run in parallel. The first attempt
+// (in order, not in time) to succeed wins, and the attempts after it are cancelled, so the
+// output is the same as when running the attempts one at a time.
+void run_and_write(const Options& options, ThreadPool* pool, const std::string& name, const configuru::Config& config,
+                   const Model& model)
+{
+	const size_t kMaxAttempts = 10;
+
 	const size_t limit       = config.get_or("limit",       0);
 	const size_t screenshots = config.get_or("screenshots", 2);
+	const size_t backtracks  = config.get_or("backtracks",  0);
+	size_t       race        = config.get_or("race",        1);
+	if (race > 1 && options.export_gif) {
+		LOG_JOB_F(WARNING, "Not racing attempts since they would all write the same GIF");
+		race = 1;
+	}
+	race = std::max<size_t>(race, 1);
 
+	const bool stats_enabled = options.stats_file != nullptr;
+	JobStats stats;
+
+	ThreadPool::TaskGroup group;
 	for (const auto i : irange(screenshots)) {
-		for (const auto attempt : irange(10)) {
-			(void)attempt;
-			int seed = rand();
+		pool->add(&group, [&, i]() {
+			current_job() = name; // We may be stealing this from another job's thread
+			for (size_t first = 0; first < kMaxAttempts; first += race) {
+				const size_t num_racing = std::min(race, kMaxAttempts - first);
+				std::vector<Output>            outputs(num_racing);
+				std::vector<Result>            results(num_racing, Result::kUnfinished);
+				std::vector<std::atomic<bool>> cancelled(num_racing);
+				for (auto& flag : cancelled) { flag = false; }
+
+				ThreadPool::TaskGroup racers;
+				for (size_t k = 0; k < num_racing; ++k) {
+					pool->add(&racers, [&, k]() {
+						current_job() = name;
+						PhaseTimes times;
+						results[k] = run_attempt(options, name, model, i, first + k, limit, backtracks, &cancelled[k],
+						                         &outputs[k], stats_enabled ? &times : nullptr);
+						if (stats_enabled) {
+							stats.add(outputs[k], times);
+						}
+						if (results[k] == Result::kSuccess) {
+							for (size_t later = k + 1; later < num_racing; ++later) {
+								cancelled[later] = true;
+							}
+						}
+					});
+				}
+				pool->wait(&racers);
+
+				const auto winner = std::find(results.begin(), results.end(), Result::kSuccess) - results.begin();
+				if (winner < num_racing) {
+					const auto image = model.image(outputs[winner]);
+					const auto out_path = emilib::strprintf("output/%s_%lu.png", name.c_str(), i);
+					TRACE_SCOPE("stbi_write_png", out_path);
+					CHECK_F(stbi_write_png(out_path.c_str(), image.width(), image.height(), 4, image.data(), 0) != 0,
+					        "Failed to write image to %s", out_path.c_str());
+					return;
+				}
+			}
+		});
+	}
+	pool->wait(&group);
+
+	if (stats_enabled) {
+		write_stats(options.stats_file, name, stats);
+	}
+}
+
+// ----------------------------------------------------------------------------
+// An unbounded world, generated chunk by chunk on request.
+// A chunk of chunk_size X chunk_size cells is generated by a non-periodic model with a ring of border cells around
+// the chunk, where border is how far the patterns of the model reach (n - 1 for an overlapping model, 1 for a tiled
+// one). The model may have more cells to the right and below, as long as those are on its boundary. Before running,
+// the ring cells of neighbors which have already been generated are fixed, so the new chunk fits against them.
+// Neighbors can contradict each other though, and then the chunk only fits all but one of them (see chunk()).
+// Only the cached_chunks most recently used chunks are kept whole. Of the others only the border strips along their
+// edges are kept (which is all the neighbors need), up to cached_borders chunks' worth, so memory stays bounded.
+// A chunk which is requested again after being evicted is regenerated with its old edges fixed, so it still fits its
+// neighbors, but its inside may differ. Every chunk has the same number of cells and a fixed number of attempts,
+// so the time per chunk does not grow with the size of the world.
+
+// The neighbors of a chunk: first the ones which only touch its corners, then the ones sharing an edge with it.
+const int kNumChunkNeighbors = 8;
+const int kChunkNeighbors[kNumChunkNeighbors][2] = {{-1, -1}, {1, -1}, {-1, 1}, {1, 1}, {-1, 0}, {0, -1}, {1, 0}, {0, 1}};
+
+class ChunkedWorld
+{
+public:
+	struct Chunk
+	{
+		Array2D<size_t> patterns; // chunk_size X chunk_size, the pattern picked for each cell
+		Image           image;    // The part of the model image covering the chunk
+	};
+
+	ChunkedWorld(const Model& model, size_t chunk_size, size_t border, uint64_t seed, size_t backtracks,
+	             size_t cached_chunks, size_t cached_borders);
+
+	// Generates the chunk unless cached. The pointer is valid until the next call.
+	// If the neighbors of the chunk leave no way to fill it in, it is made to fit all but one of them,
+	// which leaves a seam there. Returns nullptr if that fails too.
+	const Chunk* chunk(int cx, int cy);
+
+private:
+	// The cells within _border of each edge of a chunk.
+	struct Borders
+	{
+		Array2D<size_t> left, right; // _border X _chunk_size
+		Array2D<size_t> top, bottom; // _chunk_size X _border
+	};
+
+	static uint64_t chunk_key(int cx, int cy)
+	{
+		return (uint64_t(uint32_t(cx)) << 32) | uint32_t(cy);
+	}
+
+	// The pattern at cell x, y relative to chunk cx, cy if it has been generated, else kInvalidIndex.
+	size_t known_pattern(int cx, int cy, int x, int y);
+
+	// Ban everything but the known patterns in the ring around the chunk (and in its own edges, if regenerating it),
+	// except in the cells of the neighbor kChunkNeighbors[skipped], unless skipped is -1.
+	bool fix_known_cells(int cx, int cy, int skipped, Output* output);
+
+	const Model&                    _model;
+	int                             _chunk_size;
+	int                             _border;
+	uint64_t                        _seed;
+	size_t                          _backtracks;
+	LruCache<uint64_t, Chunk>       _chunks;
+	LruCache<uint64_t, Borders>     _borders;
+};
+
+ChunkedWorld::ChunkedWorld(const Model& model, size_t chunk_size, size_t border, uint64_t seed, size_t backtracks,
+                           size_t cached_chunks, size_t cached_borders)
+	: _model(model), _chunk_size(chunk_size), _border(border), _seed(seed), _backtracks(backtracks)
+	, _chunks(std::max<size_t>(cached_chunks, 1)), _borders(std::max<size_t>(cached_borders, 1))
+{
+	CHECK_F(!model._periodic_out, "A chunked world needs a non-periodic model");
+	CHECK_F(model._foundation == kInvalidIndex, "A chunked world can not have a foundation");
+	CHECK_GE_F(model._width,  chunk_size + 2 * border);
+	CHECK_GE_F(model._height, chunk_size + 2 * border);
+	CHECK_F(!model.on_boundary(chunk_size + 2 * border - 1, chunk_size + 2 * border - 1),
+	        "The ring around a chunk must not be on the boundary of the model");
+	CHECK_GE_F(chunk_size, border);
+}
 
-			Output output = create_output(model);
+size_t ChunkedWorld::known_pattern(int cx, int cy, int x, int y)
+{
+	const int size = _chunk_size;
+	const int64_t world_x = int64_t(cx) * size + x;
+	const int64_t world_y = int64_t(cy) * size + y;
+	const int64_t owner_x = world_x >= 0 ? world_x / size : (world_x + 1) / size - 1;
+	const int64_t owner_y = world_y >= 0 ? world_y / size : (world_y + 1) / size - 1;
+	const int lx = world_x - owner_x * size;
+	const int ly = world_y - owner_y * size;
+
+	const uint64_t key = chunk_key(owner_x, owner_y);
+	if (const Chunk* chunk = _chunks.find(key)) {
+		return chunk->patterns.get(lx, ly);
+	}
+	if (const Borders* borders = _borders.find(key)) {
+		if (lx < _border)         { return borders->left.get(lx, ly); }
+		if (lx >= size - _border) { return borders->right.get(lx - (size - _border), ly); }
+		if (ly < _border)         { return borders->top.get(lx, ly); }
+		if (ly >= size - _border) { return borders->bottom.get(lx, ly - (size - _border)); }
+	}
+	return kInvalidIndex;
+}
 
-			jo_gif_t gif;
+bool ChunkedWorld::fix_known_cells(int cx, int cy, int skipped, Output* output)
+{
+	// The chunk which x, y is in, relative to this one, is -1, 0 or 1 along each axis since _border <= _chunk_size:
+	const auto owner = [this](int x) { return x < _border ? -1 : x < _border + _chunk_size ? 0 : 1; };
+
+	for (const auto y : irange<int>(_model._height)) {
+		for (const auto x : irange<int>(_model._width)) {
+			if (_model.on_boundary(x, y)) { continue; }
+			if (skipped >= 0 && owner(x) == kChunkNeighbors[skipped][0] && owner(y) == kChunkNeighbors[skipped][1]) {
+				continue;
+			}
+			const size_t known = known_pattern(cx, cy, x - _border, y - _border);
+			if (known == kInvalidIndex) { continue; }
+			if (!output->_wave.get(x, y, known)) { return false; }
+			output->_wave.for_each_set(x, y, [&](size_t t) {
+				if (t != known) {
+					ban(_model, output, x, y, t);
+				}
+			});
+		}
+	}
+	return _model.propagate(output) != Result::kFail;
+}
 
-			if (options.export_gif) {
-				const auto initial_image = model.image(output);
-				const auto gif_path = emilib::strprintf("output/%s_%lu.gif", name.c_str(), i);
-				const int gif_palette_size = 255; // TODO
-				gif = jo_gif_start(gif_path.c_str(), initial_image.width(), initial_image.height(), 0, gif_palette_size);
+const ChunkedWorld::Chunk* ChunkedWorld::chunk(int cx, int cy)
+{
+	const size_t kMaxAttempts = 10;
+
+	const uint64_t key = chunk_key(cx, cy);
+	if (const Chunk* cached = _chunks.find(key)) { return cached; }
+
+	// Neighbors which were generated without knowing about each other can leave no pattern for the cells between
+	// them. Then we try without the cells of one of them, starting with those that only touch a corner.
+	for (int skipped = -1; skipped < kNumChunkNeighbors; ++skipped) {
+		for (const auto attempt : irange(kMaxAttempts)) {
+			Output output = create_output(_model);
+			if (!fix_known_cells(cx, cy, skipped, &output)) { break; }
+
+			const uint64_t seed = mix64(_seed ^ (key * 0x9E3779B97F4A7C15ull)
+			                            ^ ((attempt + (skipped + 1) * kMaxAttempts) * 0xC2B2AE3D27D4EB4Full));
+			if (run(&output, _model, seed, 0, _backtracks, nullptr, nullptr, nullptr) != Result::kSuccess) { continue; }
+			if (skipped >= 0) {
+				LOG_JOB_F(WARNING, "Chunk %d, %d does not fit all its neighbors, so it has a seam with chunk %d, %d", cx, cy,
+				          cx + kChunkNeighbors[skipped][0], cy + kChunkNeighbors[skipped][1]);
 			}
 
-			const auto result = run(&output, model, seed, limit, options.export_gif ? &gif : nullptr);
+			const int size = _chunk_size;
+			Chunk chunk;
+			chunk.patterns = Array2D<size_t>(size, size, kInvalidIndex);
+			for (const auto y : irange(size)) {
+				for (const auto x : irange(size)) {
+					chunk.patterns.set(x, y, output._wave.find_set_if(x + _border, y + _border, [](size_t) { return true; }));
+				}
+			}
+
+			const Image full_image = _model.image(output);
+			const size_t scale = full_image.width() / _model._width;
+			chunk.image = Image(size * scale, size * scale);
+			for (const auto y : irange(chunk.image.height())) {
+				for (const auto x : irange(chunk.image.width())) {
+					chunk.image.set(x, y, full_image.get(x + _border * scale, y + _border * scale));
+				}
+			}
+
+			Borders borders;
+			borders.left   = Array2D<size_t>(_border, size);
+			borders.right  = Array2D<size_t>(_border, size);
+			borders.top    = Array2D<size_t>(size, _border);
+			borders.bottom = Array2D<size_t>(size, _border);
+			for (const auto i : irange(size)) {
+				for (const auto b : irange(_border)) {
+					borders.left.set(b, i,   chunk.patterns.get(b, i));
+					borders.right.set(b, i,  chunk.patterns.get(size - _border + b, i));
+					borders.top.set(i, b,    chunk.patterns.get(i, b));
+					borders.bottom.set(i, b, chunk.patterns.get(i, size - _border + b));
+				}
+			}
+			_borders.insert(key, std::move(borders));
+			return &_chunks.insert(key, std::move(chunk));
+		}
+	}
+
+	LOG_JOB_F(WARNING, "Failed to generate chunk %d, %d", cx, cy);
+	return nullptr;
+}
 
-			if (options.export_gif) {
-				jo_gif_end(&gif);
+// Generates chunks_x X chunks_y chunks of the world, in row order, and writes them stitched together.
+void run_world(const std::string& name, const configuru::Config& config, const Model& model, size_t chunk_size,
+               size_t border)
+{
+	const int    chunks_x       = config.get_or("chunks_x",         4);
+	const int    chunks_y       = config.get_or("chunks_y",         4);
+	const size_t cached_chunks  = config.get_or("cached_chunks",    4);
+	const size_t cached_borders = config.get_or("cached_borders", 1024);
+	const size_t backtracks     = config.get_or("backtracks",       0);
+
+	ChunkedWorld world(model, chunk_size, border, attempt_seed(name, 0, 0), backtracks, cached_chunks, cached_borders);
+
+	Image result;
+	int num_missing = 0;
+	double max_ms = 0, sum_ms = 0;
+	for (const auto cy : irange(chunks_y)) {
+		for (const auto cx : irange(chunks_x)) {
+			const auto start = std::chrono::steady_clock::now();
+			const auto chunk = world.chunk(cx, cy);
+			const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			max_ms = std::max(max_ms, ms);
+			sum_ms += ms;
+			if (!chunk) {
+				num_missing += 1;
+				continue;
 			}
 
-			if (result == Result::kSuccess) {
-				const auto image = model.image(output);
-				const auto out_path = emilib::strprintf("output/%s_%lu.png", name.c_str(), i);
-				CHECK_F(stbi_write_png(out_path.c_str(), image.width(), image.height(), 4, image.data(), 0) != 0,
-				        "Failed to write image to %s", out_path.c_str());
-				break;
+			const size_t chunk_pixels = chunk->image.width();
+			if (result.width() == 0) {
+				result = Image(chunks_x * chunk_pixels, chunks_y * chunk_pixels, RGBA{0, 0, 0, 255});
+			}
+			for (const auto y : irange(chunk_pixels)) {
+				for (const auto x : irange(chunk_pixels)) {
+					result.set(cx * chunk_pixels + x, cy * chunk_pixels + y, chunk->image.get(x, y));
+				}
 			}
 		}
 	}
+	LOG_JOB_F(INFO, "%d chunks, %.1f ms per chunk on average, %.1f ms at most",
+	      chunks_x * chunks_y, sum_ms / (chunks_x * chunks_y), max_ms);
+
+	const auto out_path = emilib::strprintf("output/%s_world.png", name.c_str());
+	if (num_missing > 0) {
+		LOG_JOB_F(ERROR, "Failed to generate %d chunks, so not writing %s", num_missing, out_path.c_str());
+		return;
+	}
+	TRACE_SCOPE("stbi_write_png", out_path);
+	CHECK_F(stbi_write_png(out_path.c_str(), result.width(), result.height(), 4, result.data(), 0) != 0,
+	        "Failed to write image to %s", out_path.c_str());
+}
+
+Propagation parse_propagation(const std::string& name)
+{
+	if (name == "support") { return Propagation::kSupport; }
+	if (name == "mask")    { return Propagation::kMask;    }
+	ABORT_F("Unknown propagation '%s' (expected 'support' or 'mask')", name.c_str());
 }
 
-std::unique_ptr<Model> make_overlapping(const std::string& image_dir, const configuru::Config& config)
+// ----------------------------------------------------------------------------
+// An on-disk cache of PatternSet:s, so that the patterns of a sample are only extracted once.
+// A cache file is a ModelCacheHeader followed by the sections it lists, each starting 8-byte aligned.
+// It is memory-mapped, and the PatternSet points straight into the mapping, which lives as long as the model.
+
+const char     kModelCacheMagic[8] = {'W', 'F', 'C', 'M', 'O', 'D', 'E', 'L'};
+const uint32_t kModelCacheVersion  = 3; // Bump on any change to the layout or to how patterns are extracted.
+
+struct ModelCacheHeader
+{
+	char     magic[8];
+	uint32_t version;
+	uint8_t  color_index_size;   // sizeof(ColorIndex)
+	uint8_t  pattern_index_size; // 1, 2 or 4 bytes: the fewest that fit num_patterns
+	uint16_t n;
+	uint64_t key;
+	uint64_t palette_size;
+	uint64_t num_patterns;
+	uint64_t foundation;         // kInvalidIndex if none
+	uint64_t propagator_size;
+	// RGBA         palette[palette_size]
+	// ColorIndex   patterns[num_patterns * n * n]
+	// double       weights[num_patterns]
+	// uint32_t     propagator_starts[num_patterns * (2 * n - 1) * (2 * n - 1) + 1]
+	// uint8/16/32  propagator_list[propagator_size]
+};
+
+size_t align8(size_t size) { return (size + 7) & ~size_t(7); }
+
+// Everything the PatternSet of a sample depends on.
+uint64_t model_cache_key(const std::string& image_path, int n, size_t symmetry, bool periodic_in, bool has_foundation)
+{
+	ERROR_CONTEXT("hashing sample image", image_path.c_str());
+	FILE* file = fopen(image_path.c_str(), "rb");
+	CHECK_NOTNULL_F(file);
+	uint64_t hash = kFnvOffsetBasis;
+	uint8_t buffer[4096];
+	size_t num_read;
+	while ((num_read = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+		hash = fnv1a(hash, buffer, num_read);
+	}
+	fclose(file);
+
+	const uint64_t settings[] = {kModelCacheVersion, (uint64_t)n, symmetry, periodic_in, has_foundation};
+	return fnv1a(hash, settings, sizeof(settings));
+}
+
+// Returns false if the data is not a valid cache of the given key.
+// Only the header and the sizes are checked: the sections are used as they are, since save_model_cache
+// only ever renames complete files into place.
+bool read_model_cache(const uint8_t* data, size_t size, uint64_t key, PatternSet* out)
+{
+	ModelCacheHeader header;
+	if (size < sizeof(header)) { return false; }
+	memcpy(&header, data, sizeof(header));
+
+	if (memcmp(header.magic, kModelCacheMagic, sizeof(kModelCacheMagic)) != 0)  { return false; }
+	if (header.version != kModelCacheVersion)                                  { return false; }
+	if (header.color_index_size != sizeof(ColorIndex))                         { return false; }
+	if (header.pattern_index_size != pattern_index_size(header.num_patterns))  { return false; }
+	if (header.key != key)                                                     { return false; }
+	// Bound everything by the file size, so a corrupt header can't overflow the sizes below:
+	if (header.n == 0 || header.n > 64 || header.palette_size > size || header.num_patterns > size
+	    || header.propagator_size > size) {
+		return false;
+	}
+	if (header.foundation != kInvalidIndex && header.foundation >= header.num_patterns) { return false; }
+
+	const size_t n            = header.n;
+	const size_t num_patterns = header.num_patterns;
+	const size_t num_rows     = num_patterns * (2 * n - 1) * (2 * n - 1);
+
+	size_t offset = align8(sizeof(header));
+	const auto section = [&](size_t num_bytes) {
+		const uint8_t* start = data + offset;
+		offset += align8(num_bytes);
+		return start;
+	};
+	const auto palette  = reinterpret_cast<const RGBA*>        (section(header.palette_size * sizeof(RGBA)));
+	const auto patterns = reinterpret_cast<const ColorIndex*>  (section(num_patterns * n * n * sizeof(ColorIndex)));
+	const auto weights  = reinterpret_cast<const double*>      (section(num_patterns * sizeof(double)));
+	const auto starts   = reinterpret_cast<const uint32_t*>    (section((num_rows + 1) * sizeof(uint32_t)));
+	const auto list     = reinterpret_cast<const uint8_t*>     (section(header.propagator_size * header.pattern_index_size));
+	if (offset != size) { return false; }
+	if (starts[0] != 0 || starts[num_rows] != header.propagator_size) { return false; }
+
+	out->n                 = n;
+	out->foundation        = header.foundation;
+	out->palette.assign(palette, palette + header.palette_size);
+	out->weights.assign(weights, weights + num_patterns);
+	out->num_patterns      = num_patterns;
+	out->patterns          = patterns;
+	out->propagator_starts = starts;
+	out->propagator_list   = list;
+	out->propagator_size   = header.propagator_size;
+	return true;
+}
+
+// Returns false if there is no valid cache file for the key at path.
+bool load_model_cache(const std::string& path, uint64_t key, PatternSet* out)
+{
+	const int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) { return false; }
+
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size == 0) {
+		close(fd);
+		return false;
+	}
+
+	const size_t size = info.st_size;
+	void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapped == MAP_FAILED) { return false; }
+	std::shared_ptr<const void> mapping(mapped, [size](const void* data) { munmap(const_cast<void*>(data), size); });
+
+	if (!read_model_cache(static_cast<const uint8_t*>(mapped), size, key, out)) {
+		LOG_JOB_F(WARNING, "Ignoring stale or corrupt model cache %s", path.c_str());
+		return false;
+	}
+	out->storage = std::move(mapping);
+	return true;
+}
+
+// Failing to write the cache is not an error, we just have to extract the patterns again next time.
+void save_model_cache(const std::string& path, uint64_t key, const PatternSet& pattern_set)
+{
+	const size_t n = pattern_set.n;
+
+	ModelCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, kModelCacheMagic, sizeof(kModelCacheMagic));
+	header.version            = kModelCacheVersion;
+	header.color_index_size   = sizeof(ColorIndex);
+	header.pattern_index_size = pattern_index_size(pattern_set.num_patterns);
+	header.n                  = n;
+	header.key                = key;
+	header.palette_size       = pattern_set.palette.size();
+	header.num_patterns       = pattern_set.num_patterns;
+	header.foundation         = pattern_set.foundation;
+	header.propagator_size    = pattern_set.propagator_size;
+
+	const size_t num_rows = pattern_set.num_patterns * (2 * n - 1) * (2 * n - 1);
+
+	std::vector<uint8_t> data;
+	const auto append = [&](const void* section, size_t num_bytes) {
+		const auto bytes = static_cast<const uint8_t*>(section);
+		data.insert(data.end(), bytes, bytes + num_bytes);
+		data.resize(align8(data.size()), 0);
+	};
+	append(&header,                        sizeof(header));
+	append(pattern_set.palette.data(),     pattern_set.palette.size() * sizeof(RGBA));
+	append(pattern_set.patterns,           pattern_set.num_patterns * n * n * sizeof(ColorIndex));
+	append(pattern_set.weights.data(),     pattern_set.weights.size() * sizeof(double));
+	append(pattern_set.propagator_starts,  (num_rows + 1) * sizeof(uint32_t));
+	append(pattern_set.propagator_list,    pattern_set.propagator_size * header.pattern_index_size);
+
+	// Write to a temporary file first, so that nobody maps a half-written cache file:
+	// Other threads and other processes may be writing the same one, so the name has to be unique to both:
+	const auto temp_path = emilib::strprintf("%s.%d.%lu.tmp", path.c_str(), (int)getpid(),
+		std::hash<std::thread::id>()(std::this_thread::get_id()));
+	FILE* file = fopen(temp_path.c_str(), "wb");
+	if (!file) {
+		LOG_JOB_F(WARNING, "Failed to write model cache %s", temp_path.c_str());
+		return;
+	}
+	const bool written = fwrite(data.data(), 1, data.size(), file) == data.size();
+	if (fclose(file) != 0 || !written || rename(temp_path.c_str(), path.c_str()) != 0) {
+		LOG_JOB_F(WARNING, "Failed to write model cache %s", path.c_str());
+		remove(temp_path.c_str());
+	}
+}
+
+// ----------------------------------------------------------------------------
+
+// What to generate: the size of the outputs, and whether they wrap around.
+struct OutputShape
+{
+	size_t width;
+	size_t height;
+	bool   periodic;
+};
+
+std::unique_ptr<Model> make_overlapping(const Options& options, ThreadPool* pool, const std::string& image_dir,
+                                        const configuru::Config& config, const OutputShape& shape)
 {
 	const auto image_filename = config["image"].as_string();
 	const auto in_path = image_dir + image_filename;
 
 	const int    n              = config.get_or("n",             3);
-	const size_t out_width      = config.get_or("width",        48);
-	const size_t out_height     = config.get_or("height",       48);
 	const size_t symmetry       = config.get_or("symmetry",      8);
-	const bool   periodic_out   = config.get_or("periodic_out", true);
 	const bool   periodic_in    = config.get_or("periodic_in",  true);
 	const auto   has_foundation = config.get_or("foundation",   false);
+	const auto   propagation    = parse_propagation(config.get_or("propagation", "support"));
 
-	const auto sample_image = load_paletted_image(in_path.c_str());
-	LOG_F(INFO, "palette size: %lu", sample_image.palette.size());
-	PatternHash foundation = kInvalidHash;
-	const auto hashed_patterns = extract_patterns(sample_image, n, periodic_in, symmetry, has_foundation ? &foundation : nullptr);
-	LOG_F(INFO, "Found %lu unique patterns in sample image", hashed_patterns.size());
+	PatternSet pattern_set;
 
-	return std::unique_ptr<Model>{
-		new OverlappingModel{hashed_patterns, sample_image.palette, n, periodic_out, out_width, out_height, foundation}
-	};
+	uint64_t cache_key = 0;
+	std::string cache_path;
+	if (!options.cache_dir.empty()) {
+		cache_key = model_cache_key(in_path, n, symmetry, periodic_in, has_foundation);
+		cache_path = emilib::strprintf("%s/%016llx.wfcmodel", options.cache_dir.c_str(), (unsigned long long)cache_key);
+	}
+
+	if (!cache_path.empty() && load_model_cache(cache_path, cache_key, &pattern_set)) {
+		LOG_JOB_F(INFO, "Loaded %lu patterns from %s", pattern_set.num_patterns, cache_path.c_str());
+	} else {
+		const auto sample_image = load_paletted_image(in_path.c_str());
+		LOG_JOB_F(INFO, "palette size: %lu", sample_image.palette.size());
+		size_t foundation = kInvalidIndex;
+		const auto patterns = extract_patterns(sample_image, n, periodic_in, symmetry, has_foundation ? &foundation : nullptr);
+		LOG_JOB_F(INFO, "Found %lu unique patterns in sample image", patterns.size());
+		pattern_set = make_pattern_set(pool, patterns, sample_image.palette, n, foundation);
+
+		if (!cache_path.empty()) {
+			save_model_cache(cache_path, cache_key, pattern_set);
+		}
+	}
+
+	return make_overlapping_model(std::move(pattern_set), shape.periodic, shape.width, shape.height, propagation);
 }
 
-std::unique_ptr<Model> make_tiled(const std::string& image_dir, const configuru::Config& config)
+std::unique_ptr<Model> make_tiled(const std::string& image_dir, const configuru::Config& config, const OutputShape& shape)
 {
-	const std::string subdir     = config["subdir"].as_string();
-	const size_t      out_width  = config.get_or("width",    48);
-	const size_t      out_height = config.get_or("height",   48);
-	const std::string subset     = config.get_or("subset",   std::string());
-	const bool        periodic   = config.get_or("periodic", false);
+	const std::string subdir      = config["subdir"].as_string();
+	const std::string subset      = config.get_or("subset",   std::string());
+	const auto        propagation = parse_propagation(config.get_or("propagation", "support"));
 
 	const TileLoader tile_loader = [&](const std::string& tile_name) -> Tile
 	{
@@ -1071,37 +2624,334 @@ std::unique_ptr<Model> make_tiled(const std::string& image_dir, const configuru:
 	const auto root_dir = image_dir + subdir + "/";
 	const auto tile_config = configuru::parse_file(root_dir + "data.cfg", configuru::CFG);
 	return std::unique_ptr<Model>{
-		new TileModel(tile_config, subset, out_width, out_height, periodic, tile_loader)
+		new TileModel(tile_config, subset, shape.width, shape.height, shape.periodic, propagation, tile_loader)
 	};
 }
 
-void run_config_file(const Options& options, const std::string& path)
+struct Job
 {
-	LOG_F(INFO, "Running all samples in %s", path.c_str());
-	const auto samples = configuru::parse_file(path, configuru::CFG);
-	const auto image_dir = samples["image_dir"].as_string();
+	bool                     tiled;
+	std::string              name;
+	const configuru::Config* config;
+};
 
+// All the jobs of a sample file, in the order of the file.
+std::vector<Job> load_jobs(const configuru::Config& samples)
+{
+	std::vector<Job> jobs;
 	if (samples.count("overlapping")) {
 		for (const auto& p : samples["overlapping"].as_object()) {
-			LOG_SCOPE_F(INFO, "%s", p.key().c_str());
-			const auto model = make_overlapping(image_dir, p.value());
-			run_and_write(options, p.key(), p.value(), *model);
-			p.value().check_dangling();
+			jobs.push_back(Job{false, p.key(), &p.value()});
 		}
 	}
-
 	if (samples.count("tiled")) {
 		for (const auto& p : samples["tiled"].as_object()) {
-			LOG_SCOPE_F(INFO, "Tiled %s", p.key().c_str());
-			const auto model = make_tiled(image_dir, p.value());
-			run_and_write(options, p.key(), p.value(), *model);
+			jobs.push_back(Job{true, p.key(), &p.value()});
+		}
+	}
+	return jobs;
+}
+
+// The shape of the screenshots of a job.
+OutputShape screenshot_shape(const Job& job)
+{
+	const auto& config = *job.config;
+	OutputShape shape;
+	shape.width    = config.get_or("width",  48);
+	shape.height   = config.get_or("height", 48);
+	shape.periodic = job.tiled ? config.get_or("periodic", false) : config.get_or("periodic_out", true);
+	return shape;
+}
+
+std::unique_ptr<Model> make_model(const Options& options, ThreadPool* pool, const std::string& image_dir, const Job& job,
+                                  const OutputShape& shape)
+{
+	return job.tiled ? make_tiled(image_dir, *job.config, shape)
+	                 : make_overlapping(options, pool, image_dir, *job.config, shape);
+}
+
+// A job with a chunk_size generates a ChunkedWorld instead of screenshots.
+void run_job(const Options& options, ThreadPool* pool, const std::string& image_dir, const Job& job)
+{
+	const auto& config = *job.config;
+	current_job() = job.name;
+	LOG_SCOPE_F(INFO, "%s%s", job.tiled ? "Tiled " : "", job.name.c_str());
+	TRACE_SCOPE("run_job", job.name);
+
+	const size_t chunk_size = config.get_or("chunk_size", 0);
+	const size_t border     = job.tiled ? 1 : config.get_or("n", 3) - 1; // How far the patterns reach
+
+	OutputShape shape = screenshot_shape(job);
+	if (chunk_size > 0) {
+		// The last n - 1 cells of an overlapping model are on the boundary, so we need that many more (see ChunkedWorld).
+		const size_t size = chunk_size + 2 * border + (job.tiled ? 0 : border);
+		shape.width    = size;
+		shape.height   = size;
+		shape.periodic = false;
+	}
+
+	const auto model = make_model(options, pool, image_dir, job, shape);
+	if (chunk_size > 0) {
+		run_world(job.name, config, *model, chunk_size, border);
+	} else {
+		run_and_write(options, pool, job.name, config, *model);
+	}
+	if (!job.tiled) {
+		config.check_dangling();
+	}
+}
+
+// The jobs are run by options.max_jobs runners, each building and running one model at a time,
+// so that is how many models are in memory at once. The screenshots of the jobs are spread over all threads.
+// The output of a job only depends on its config and name, not on the order the jobs happen to run in.
+// Jobs of the same name write to the same files, so they are run one after the other, in the order of the file.
+void run_config_file(const Options& options, ThreadPool* pool, const std::string& path)
+{
+	LOG_JOB_F(INFO, "Running all samples in %s", path.c_str());
+	const auto samples = configuru::parse_file(path, configuru::CFG);
+	const auto image_dir = samples["image_dir"].as_string();
+
+	std::vector<std::vector<Job>> chains; // Jobs of the same name
+	std::unordered_map<std::string, size_t> chain_from_name;
+	for (const auto& job : load_jobs(samples)) {
+		const auto it = chain_from_name.emplace(job.name, chains.size()).first;
+		if (it->second == chains.size()) { chains.emplace_back(); }
+		chains[it->second].push_back(job);
+	}
+
+	const size_t max_jobs = options.max_jobs > 0 ? options.max_jobs : pool->num_threads();
+	const size_t num_runners = std::min(max_jobs, chains.size());
+	std::atomic<size_t> next_chain{0};
+
+	ThreadPool::TaskGroup runners;
+	for (size_t i = 0; i < num_runners; ++i) {
+		pool->add(&runners, [&]() {
+			for (size_t c = next_chain++; c < chains.size(); c = next_chain++) {
+				for (const auto& job : chains[c]) {
+					run_job(options, pool, image_dir, job);
+				}
+			}
+		});
+	}
+	pool->wait(&runners);
+	current_job() = "main";
+}
+
+#if WFC_BENCH
+// ----------------------------------------------------------------------------
+// wfc_bench.bin, built and run by WFC_BENCH=1 ./main.cpp [arguments]. Times the jobs of sample files on one thread,
+// each with the seed of its first screenshot, so that the numbers of two versions of the solver can be compared.
+
+const auto kBenchUsage = R"(
+wfc_bench.bin [-h/--help] [--warmup N] [--reps N] [--out PREFIX] [job=samples.cfg, ...]
+	-h/--help    Print this help
+	--warmup N   Untimed runs of each job before the timed ones (default: 1)
+	--reps N     Timed runs of each job (default: 5)
+	--out PREFIX Write PREFIX.json (medians and minimums per job) and PREFIX.csv (every run) (default: output/bench)
+	file         Jobs to run. Jobs generating a chunked world are skipped.
+The peak_rss_kb of a job is from one more run of it in a child process, so it is of that job alone.
+)";
+
+struct BenchRun
+{
+	Result     result;
+	double     build = 0; // Seconds to build the model
+	double     init  = 0; // Seconds in create_output
+	PhaseTimes phases;
+	size_t     iterations;
+	size_t     bans;
+};
+
+BenchRun bench_run(const std::string& image_dir, const Job& job)
+{
+	const auto& config = *job.config;
+	const size_t limit      = config.get_or("limit",      0);
+	const size_t backtracks = config.get_or("backtracks", 0);
+
+	ThreadPool pool(1);
+	BenchRun bench;
+	std::unique_ptr<Model> model;
+	{
+		ScopedTimer timer(&bench.build);
+		model = make_model(Options(), &pool, image_dir, job, screenshot_shape(job));
+	}
+
+	Output output;
+	{
+		ScopedTimer timer(&bench.init);
+		output = create_output(*model);
+	}
+	bench.result = run(&output, *model, attempt_seed(job.name, 0, 0), limit, backtracks, nullptr, nullptr, &bench.phases);
+	bench.iterations = output._num_observations;
+	bench.bans       = output._num_bans;
+
+	Image image;
+	{
+		ScopedTimer timer(&bench.phases.render);
+		image = model->image(output);
+	}
+	{
+		ScopedTimer timer(&bench.phases.encode);
+		size_t num_bytes = 0;
+		const auto count_bytes = [](void* context, void*, int size) { *static_cast<size_t*>(context) += size; };
+		stbi_write_png_to_func(count_bytes, &num_bytes, image.width(), image.height(), 4, image.data(), 0);
+	}
+
+	return bench;
+}
+
+// The peak resident memory of a run of the job in a forked child. getrusage(RUSAGE_SELF) would only give the
+// high-water mark of the whole benchmark so far. The child starts out with what this process has resident,
+// so with glibc the heap left over from earlier jobs is handed back first. -1 if the child could not be run.
+long bench_peak_rss_kb(const std::string& image_dir, const Job& job)
+{
+#if defined(__GLIBC__)
+	malloc_trim(0);
+#endif
+	const pid_t pid = fork();
+	if (pid < 0) { return -1; }
+	if (pid == 0) {
+		bench_run(image_dir, job);
+		_exit(0);
+	}
+
+	int status;
+	rusage usage;
+	if (wait4(pid, &status, 0, &usage) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		LOG_JOB_F(WARNING, "Failed to measure the memory of %s", job.name.c_str());
+		return -1;
+	}
+	return usage.ru_maxrss;
+}
+
+int bench_main(int argc, char* argv[])
+{
+	loguru::init(argc, argv);
+	LOG_JOB_F(INFO, "Using %s bit kernels", bit_kernels().name);
+
+	size_t warmup = 1;
+	size_t reps   = 5;
+	std::string out_prefix = "output/bench";
+	std::vector<std::string> files;
+
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+			printf(kBenchUsage);
+			exit(0);
+		} else if (strcmp(argv[i], "--warmup") == 0) {
+			CHECK_LT_F(i + 1, argc, "--warmup expects a number");
+			warmup = std::max(0, atoi(argv[++i]));
+		} else if (strcmp(argv[i], "--reps") == 0) {
+			CHECK_LT_F(i + 1, argc, "--reps expects a number");
+			reps = std::max(1, atoi(argv[++i]));
+		} else if (strcmp(argv[i], "--out") == 0) {
+			CHECK_LT_F(i + 1, argc, "--out expects a path prefix");
+			out_prefix = argv[++i];
+		} else {
+			files.push_back(argv[i]);
 		}
 	}
+
+	if (files.empty()) {
+		files.push_back("samples.cfg");
+	}
+
+	const auto csv_path  = out_prefix + ".csv";
+	const auto json_path = out_prefix + ".json";
+	FILE* csv  = fopen(csv_path.c_str(),  "w");
+	FILE* json = fopen(json_path.c_str(), "w");
+	CHECK_NOTNULL_F(csv,  "Failed to open %s", csv_path.c_str());
+	CHECK_NOTNULL_F(json, "Failed to open %s", json_path.c_str());
+
+	fprintf(csv, "name,tiled,rep,result,iterations,bans,build_s,init_s,observe_s,propagate_s,render_s,encode_s,"
+	             "bans_per_s\n");
+	fprintf(json, "{\n\t\"bit_kernels\": \"%s\",\n\t\"warmup\": %lu,\n\t\"reps\": %lu,\n\t\"jobs\": [",
+	        bit_kernels().name, warmup, reps);
+
+	const auto median_and_min = [](std::vector<double> values) {
+		std::sort(values.begin(), values.end());
+		return emilib::strprintf("{\"median\": %.6f, \"min\": %.6f}", values[values.size() / 2], values[0]);
+	};
+
+	bool first_job = true;
+	for (const auto& file : files) {
+		const auto samples = configuru::parse_file(file, configuru::CFG);
+		const auto image_dir = samples["image_dir"].as_string();
+
+		for (const auto& job : load_jobs(samples)) {
+			if (job.config->get_or("chunk_size", 0) > 0) {
+				LOG_JOB_F(INFO, "Skipping %s: chunked worlds are not benchmarked", job.name.c_str());
+				continue;
+			}
+
+			current_job() = job.name;
+			for (size_t i = 0; i < warmup; ++i) {
+				bench_run(image_dir, job);
+			}
+			const long peak_rss_kb = bench_peak_rss_kb(image_dir, job);
+
+			std::vector<BenchRun> runs;
+			for (size_t rep = 0; rep < reps; ++rep) {
+				runs.push_back(bench_run(image_dir, job));
+				const auto& r = runs.back();
+				const double solve = r.phases.observe + r.phases.propagate;
+				fprintf(csv, "%s,%d,%lu,%s,%lu,%lu,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f,%.0f\n",
+				        job.name.c_str(), job.tiled, rep, result2str(r.result), r.iterations, r.bans, r.build, r.init,
+				        r.phases.observe, r.phases.propagate, r.phases.render, r.phases.encode,
+				        solve > 0 ? r.bans / solve : 0.0);
+				if (r.iterations != runs[0].iterations || r.result != runs[0].result) {
+					LOG_JOB_F(WARNING, "%s is not reproducible: %lu iterations, %lu the first time", job.name.c_str(),
+					      r.iterations, runs[0].iterations);
+				}
+			}
+
+			std::vector<double> build, init, observe, propagate, render, encode, bans_per_s;
+			for (const auto& r : runs) {
+				build.push_back(r.build);
+				init.push_back(r.init);
+				observe.push_back(r.phases.observe);
+				propagate.push_back(r.phases.propagate);
+				render.push_back(r.phases.render);
+				encode.push_back(r.phases.encode);
+				const double solve = r.phases.observe + r.phases.propagate;
+				bans_per_s.push_back(solve > 0 ? r.bans / solve : 0.0);
+			}
+
+			const auto& r = runs[0];
+			fprintf(json, "%s\n\t\t{\"name\": \"%s\", \"tiled\": %s, \"result\": \"%s\", \"iterations\": %lu, \"bans\": %lu,"
+			              " \"build_s\": %s, \"init_s\": %s, \"observe_s\": %s, \"propagate_s\": %s, \"render_s\": %s,"
+			              " \"encode_s\": %s, \"bans_per_s\": %s, \"peak_rss_kb\": %ld}",
+			        first_job ? "" : ",", job.name.c_str(), job.tiled ? "true" : "false", result2str(r.result),
+			        r.iterations, r.bans, median_and_min(build).c_str(), median_and_min(init).c_str(),
+			        median_and_min(observe).c_str(), median_and_min(propagate).c_str(), median_and_min(render).c_str(),
+			        median_and_min(encode).c_str(), median_and_min(bans_per_s).c_str(), peak_rss_kb);
+			first_job = false;
+
+			std::sort(observe.begin(), observe.end());
+			std::sort(propagate.begin(), propagate.end());
+			LOG_JOB_F(INFO, "%s: %s after %lu iterations, median observe %.1f ms, propagate %.1f ms",
+			      job.name.c_str(), result2str(r.result), r.iterations,
+			      1e3 * observe[observe.size() / 2], 1e3 * propagate[propagate.size() / 2]);
+		}
+	}
+
+	fprintf(json, "\n\t]\n}\n");
+	fclose(json);
+	fclose(csv);
+	current_job() = "main";
+	LOG_JOB_F(INFO, "Wrote %s and %s", json_path.c_str(), csv_path.c_str());
+	return 0;
 }
 
+int main(int argc, char* argv[])
+{
+	return bench_main(argc, argv);
+}
+#else
 int main(int argc, char* argv[])
 {
 	loguru::init(argc, argv);
+	LOG_JOB_F(INFO, "Using %s bit kernels", bit_kernels().name);
 
 	Options options;
 
@@ -1113,7 +2963,25 @@ int main(int argc, char* argv[])
 			exit(0);
 		} else if (strcmp(argv[i], "--gif") == 0) {
 			options.export_gif = true;
-			LOG_F(INFO, "Enabled GIF exporting");
+			LOG_JOB_F(INFO, "Enabled GIF exporting");
+		} else if (strcmp(argv[i], "--threads") == 0) {
+			CHECK_LT_F(i + 1, argc, "--threads expects a number");
+			options.num_threads = std::max(1, atoi(argv[++i]));
+		} else if (strcmp(argv[i], "--cache") == 0) {
+			CHECK_LT_F(i + 1, argc, "--cache expects a directory");
+			options.cache_dir = argv[++i];
+			mkdir(options.cache_dir.c_str(), 0755); // Fine if it already exists
+		} else if (strcmp(argv[i], "--jobs") == 0) {
+			CHECK_LT_F(i + 1, argc, "--jobs expects a number");
+			options.max_jobs = std::max(1, atoi(argv[++i]));
+		} else if (strcmp(argv[i], "--stats") == 0) {
+			const char* stats_path = "output/stats.jsonl";
+			options.stats_file = fopen(stats_path, "w");
+			CHECK_NOTNULL_F(options.stats_file, "Failed to open %s", stats_path);
+		} else if (strcmp(argv[i], "--trace") == 0) {
+			CHECK_LT_F(i + 1, argc, "--trace expects a file name");
+			options.trace_path = argv[++i];
+			Tracer::start();
 		} else {
 			files.push_back(argv[i]);
 		}
@@ -1123,7 +2991,19 @@ int main(int argc, char* argv[])
 		files.push_back("samples.cfg");
 	}
 
+	ThreadPool pool(options.num_threads);
+	LOG_JOB_F(INFO, "Running on %lu threads", pool.num_threads());
+
 	for (const auto& file : files) {
-		run_config_file(options, file);
+		run_config_file(options, &pool, file);
+	}
+
+	if (!options.trace_path.empty()) {
+		CHECK_F(Tracer::write(options.trace_path), "Failed to write %s", options.trace_path.c_str());
+		LOG_JOB_F(INFO, "Wrote trace to %s", options.trace_path.c_str());
+	}
+	if (options.stats_file) {
+		CHECK_F(fclose(options.stats_file) == 0, "Failed to write the --stats file");
 	}
 }
+#endif // WFC_BENCH
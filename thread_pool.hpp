@@ -0,0 +1,164 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// A fixed set of worker threads running tasks, with work stealing.
+// Every thread has its own queue: tasks are added to the back of the queue of the adding thread,
+// which takes them from the back again, while idle threads steal from the front of the others.
+// A thread waiting on a TaskGroup helps out by running tasks of that group (and only those, so
+// that a thread never has more than one job in flight), so tasks can add and wait on tasks of their
+// own without deadlocking, and a pool of one thread runs everything on the waiter.
+class ThreadPool
+{
+public:
+	using Task = std::function<void()>;
+
+	// Tasks which are waited on together.
+	class TaskGroup
+	{
+	public:
+		TaskGroup() {}
+		TaskGroup(const TaskGroup&) = delete;
+		TaskGroup& operator=(const TaskGroup&) = delete;
+
+	private:
+		friend class ThreadPool;
+		size_t _num_unfinished = 0; // Guarded by ThreadPool::_mutex
+	};
+
+	// num_threads includes the thread calling wait, so num_threads - 1 workers are started.
+	explicit ThreadPool(size_t num_threads) : _queues(num_threads)
+	{
+		for (size_t i = 1; i < num_threads; ++i) {
+			_workers.emplace_back([this, i]() { work(i); });
+		}
+	}
+
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_stop = true;
+		}
+		_cv.notify_all();
+		for (auto& worker : _workers) {
+			worker.join();
+		}
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	size_t num_threads() const { return _queues.size(); }
+
+	void add(TaskGroup* group, Task task)
+	{
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			group->_num_unfinished += 1;
+			_queues[queue_index()].push_back(Job{group, std::move(task)});
+		}
+		_cv.notify_all();
+	}
+
+	// Returns when all tasks of the group have finished, running its queued tasks in the meantime.
+	void wait(TaskGroup* group)
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		while (group->_num_unfinished > 0) {
+			Job job;
+			if (take(group, &job)) {
+				run(lock, &job);
+			} else {
+				_cv.wait(lock);
+			}
+		}
+	}
+
+private:
+	struct Job
+	{
+		TaskGroup* group = nullptr;
+		Task       task;
+	};
+
+	// Threads outside of the pool (e.g. main) share queue 0 with the first thread calling wait.
+	size_t queue_index() const
+	{
+		return this_pool() == this ? this_queue() : 0;
+	}
+
+	static const ThreadPool*& this_pool()  { static thread_local const ThreadPool* s_pool  = nullptr; return s_pool;  }
+	static size_t&            this_queue() { static thread_local size_t            s_queue = 0;       return s_queue; }
+
+	void work(size_t index)
+	{
+		this_pool()  = this;
+		this_queue() = index;
+
+		std::unique_lock<std::mutex> lock(_mutex);
+		for (;;) {
+			Job job;
+			if (take(nullptr, &job)) {
+				run(lock, &job);
+			} else if (_stop) {
+				return;
+			} else {
+				_cv.wait(lock);
+			}
+		}
+	}
+
+	// Take a task (of the given group, unless nullptr): the newest of our own, else the oldest of someone else's.
+	// Called with the lock held.
+	bool take(const TaskGroup* group, Job* out_job)
+	{
+		const size_t own = queue_index();
+		auto& own_queue = _queues[own];
+		for (auto it = own_queue.rbegin(); it != own_queue.rend(); ++it) {
+			if (group == nullptr || it->group == group) {
+				*out_job = std::move(*it);
+				own_queue.erase(std::next(it).base());
+				return true;
+			}
+		}
+
+		for (size_t i = 1; i < _queues.size(); ++i) {
+			auto& victim = _queues[(own + i) % _queues.size()];
+			for (auto it = victim.begin(); it != victim.end(); ++it) {
+				if (group == nullptr || it->group == group) {
+					*out_job = std::move(*it);
+					victim.erase(it);
+					return true;
+				}
+			}
+		}
+
+		return false;
+	}
+
+	// Called with the lock held, which is released while the task runs.
+	void run(std::unique_lock<std::mutex>& lock, Job* job)
+	{
+		lock.unlock();
+		job->task();
+		lock.lock();
+
+		job->group->_num_unfinished -= 1;
+		if (job->group->_num_unfinished == 0) {
+			_cv.notify_all(); // Wake up whoever is waiting on the group
+		}
+	}
+
+	std::mutex                     _mutex;
+	std::condition_variable        _cv;
+	std::vector<std::deque<Job>>   _queues; // One per thread
+	std::vector<std::thread>       _workers;
+	bool                           _stop = false;
+};
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// str as the inside of a JSON string: quotes and backslashes escaped, control characters dropped.
+inline std::string json_escaped(const std::string& str)
+{
+	std::string result;
+	for (const char c : str) {
+		if (c == '"' || c == '\\') { result += '\\'; }
+		if (static_cast<unsigned char>(c) >= 0x20) { result += c; }
+	}
+	return result;
+}
+
+// Records timed spans, and writes them as Chrome trace events (JSON) which chrome://tracing and
+// https://ui.perfetto.dev can show as a timeline, one track per thread.
+// Nothing is recorded until Tracer::start is called, and a TRACE_SCOPE then only costs a relaxed load.
+class Tracer
+{
+public:
+	static void start()
+	{
+		instance()._start = std::chrono::steady_clock::now();
+		instance()._enabled.store(true, std::memory_order_release);
+	}
+
+	static bool enabled() { return instance()._enabled.load(std::memory_order_relaxed); }
+
+	// Microseconds since start.
+	static double now_us()
+	{
+		return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - instance()._start).count();
+	}
+
+	static void add(const char* name, const std::string& detail, double start_us, double end_us)
+	{
+		auto& tracer = instance();
+		std::lock_guard<std::mutex> lock(tracer._mutex);
+		if (tracer._spans.size() < kMaxSpans) {
+			tracer._spans.push_back(Span{name, detail, thread_id(), start_us, end_us - start_us});
+		} else {
+			tracer._num_dropped += 1;
+		}
+	}
+
+	// Returns false if the file could not be written.
+	static bool write(const std::string& path)
+	{
+		auto& tracer = instance();
+		std::lock_guard<std::mutex> lock(tracer._mutex);
+		FILE* file = fopen(path.c_str(), "w");
+		if (!file) { return false; }
+
+		fprintf(file, "{\"traceEvents\": [\n");
+		for (size_t i = 0; i < tracer._spans.size(); ++i) {
+			const auto& span = tracer._spans[i];
+			fprintf(file, "{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f",
+			        span.name, span.tid, span.start_us, span.duration_us);
+			if (!span.detail.empty()) {
+				fprintf(file, ", \"args\": {\"detail\": \"%s\"}", json_escaped(span.detail).c_str());
+			}
+			fprintf(file, "}%s\n", i + 1 < tracer._spans.size() ? "," : "");
+		}
+		fprintf(file, "],\n\"otherData\": {\"dropped_spans\": %lu}}\n", (unsigned long)tracer._num_dropped);
+		return fclose(file) == 0;
+	}
+
+private:
+	static const size_t kMaxSpans = 4 * 1024 * 1024; // A few hundred MB, so that a long run can not eat all memory
+
+	struct Span
+	{
+		const char* name; // A string literal
+		std::string detail;
+		int         tid;
+		double      start_us;
+		double      duration_us;
+	};
+
+	static Tracer& instance() { static Tracer s_tracer; return s_tracer; }
+
+	// Small and stable, unlike std::thread::id.
+	static int thread_id()
+	{
+		static std::atomic<int> s_next_id{1};
+		static thread_local int s_id = s_next_id++;
+		return s_id;
+	}
+
+	std::atomic<bool>                     _enabled{false};
+	std::chrono::steady_clock::time_point _start;
+	std::mutex                            _mutex;
+	std::vector<Span>                     _spans;
+	size_t                                _num_dropped = 0;
+};
+
+// Records a span from here to the end of the scope, if the Tracer is enabled and sample is true.
+class TraceScope
+{
+public:
+	explicit TraceScope(const char* name) : TraceScope(name, std::string()) {}
+
+	TraceScope(const char* name, std::string detail, bool sample = true)
+		: _name(Tracer::enabled() && sample ? name : nullptr)
+	{
+		if (_name) {
+			_detail   = std::move(detail);
+			_start_us = Tracer::now_us();
+		}
+	}
+
+	~TraceScope()
+	{
+		if (_name) {
+			Tracer::add(_name, _detail, _start_us, Tracer::now_us());
+		}
+	}
+
+	TraceScope(const TraceScope&) = delete;
+	TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+	const char* _name; // nullptr when not recording
+	std::string _detail;
+	double      _start_us = 0;
+};
+
+#define TRACE_CONCAT_IMPL(a, b) a ## b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_IMPL(a, b)
+// TRACE_SCOPE("name"), TRACE_SCOPE("name", detail) or TRACE_SCOPE("name", detail, sample)
+#define TRACE_SCOPE(...) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(__VA_ARGS__)